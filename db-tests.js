@@ -1,6 +1,9 @@
 
 const expect = require('chai').expect
 const exec = require('child_process').exec
+const spawn = require('child_process').spawn
+const fs = require('fs')
+const net = require('net')
 
 describe('database-tests', function (){
 
@@ -37,6 +40,51 @@ describe('database-tests', function (){
 
     }
 
+    // Lines of a .analyze fill histogram, one count per 10% bucket.
+    function histogram(counts){
+        return counts.map((count, i) => `${String(i * 10).padStart(5)}-${String(i * 10 + 10).padStart(3)}%: ${count}`)
+    }
+
+    // Run one REPL session against db and pass its output lines to callback.
+    function db_session(db, args, commands, callback){
+        const child = spawn('./db_example', [db, ...args])
+        let output = ''
+        child.stdout.on('data', (data) => output += data)
+        child.on('exit', () => callback(output.split('\n')))
+        child.stdin.write(commands.join('\n') + '\n')
+    }
+
+    // Start a --serve process directly, not under a shell, so signals reach it.
+    function start_server(db, socket_path, on_listening){
+        const server = spawn('./db_example', [db, '--serve', socket_path])
+        server.stdout.once('data', on_listening)
+        return server
+    }
+
+    // A request in the --serve wire format: 4 byte big-endian length, then the text.
+    function frame(text){
+        const header = Buffer.alloc(4)
+        header.writeUInt32BE(Buffer.byteLength(text))
+        return Buffer.concat([header, Buffer.from(text)])
+    }
+
+    // Split length-prefixed responses out of the socket's data, calling
+    // on_response with every response received so far.
+    function read_frames(socket, on_response){
+        let received = Buffer.alloc(0)
+        const responses = []
+        socket.on('data', (data) => {
+            received = Buffer.concat([received, data])
+            while (received.length >= 4 && received.length >= 4 + received.readUInt32BE(0)) {
+                const length = received.readUInt32BE(0)
+                responses.push(received.slice(4, 4 + length).toString())
+                received = received.slice(4 + length)
+                on_response(responses)
+            }
+        })
+        return responses
+    }
+
     // it('cmake build', async function build(){
     //     const {stdout, stderr} = await exec('cmake --build .')
     //     stdout.on('data', (data) => {
@@ -153,15 +201,272 @@ describe('database-tests', function (){
             'db > Constants: ',
             'ROW_SIZE: 293',
             'COMMON_NODE_HEADER_SIZE: 6',
-            'LEAF_NODE_HEADER_SIZE: 14',
+            'LEAF_NODE_HEADER_SIZE: 18',
             'LEAF_NODE_CELL_SIZE: 297',
-            'LEAF_NODE_SPACE_FOR_CELLS: 4082',
+            'LEAF_NODE_SPACE_FOR_CELLS: 4078',
             'LEAF_NODE_MAX_CELLS: 13',
             'db > '
         ]
         row_script(script, expected)
     })
 
+    it('inserts multiple rows in one statement', function () {
+        const script = [
+            'insert values (3, user3, person3@example.com), (1, user1, person1@example.com), (2, user2, person2@example.com)',
+            'insert values (4, user4, person4@example.com), (1, user1, person1@example.com)',
+            'select',
+            '.exit'
+        ]
+
+        const expected = [
+            'db > Executed .',
+            'db > Error: Duplicate key.',
+            'db > (1, user1, person1@example.com)',
+            '(2, user2, person2@example.com)',
+            '(3, user3, person3@example.com)',
+            'Executed .',
+            'db > '
+        ]
+
+        row_script(script, expected)
+    })
+
+    it('splits a full leaf once and merges the rest of the batch into both halves', function () {
+        const values = (keys) => 'insert values ' + keys.map((key) => `(${key}, user${key}, person${key}@example.com)`).join(', ')
+        const even = Array(13).fill(1).map((_, i) => 2 * i + 2)
+        const odd = Array(11).fill(1).map((_, i) => 2 * i + 1)
+        const script = [values(even), values(odd), '.btree', '.exit']
+
+        const leaf_keys = (keys) => keys.map((key) => `    - ${key}`)
+        const expected = [
+            'db > Executed .',
+            'db > Executed .',
+            'db > Tree:',
+            '- internal (size 1)',
+            '  - leaf (size 12)',
+            ...leaf_keys([1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12]),
+            '  - key 12',
+            '  - leaf (size 12)',
+            ...leaf_keys([13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 24, 26]),
+            'db > '
+        ]
+
+        row_script(script, expected)
+    })
+
+    it('selects the newest rows with order by id desc and limit', function () {
+        const script = Array(20).fill(1).map((_, i) => `insert ${i + 1} user${i + 1} person${i + 1}@example.com`)
+        script.push('select order by id desc limit 3')
+        script.push('.exit')
+
+        const expected = Array(20).fill('db > Executed .')
+        expected.push(
+            'db > (20, user20, person20@example.com)',
+            '(19, user19, person19@example.com)',
+            '(18, user18, person18@example.com)',
+            'Executed .',
+            'db > '
+        )
+
+        row_script(script, expected)
+    })
+
+    it('updates rows in place', function () {
+        const script = [1, 2, 3].map((value) => `insert ${value} user${value} person${value}@example.com`)
+        script.push('update set username=alice where id = 1')
+        script.push('update set email=new@example.com where id >= 2 and id <= 3')
+        script.push('select')
+        script.push('.exit')
+
+        const expected = [
+            'db > Executed .',
+            'db > Executed .',
+            'db > Executed .',
+            'db > Executed .',
+            'db > Executed .',
+            'db > (1, alice, person1@example.com)',
+            '(2, user2, new@example.com)',
+            '(3, user3, new@example.com)',
+            'Executed .',
+            'db > '
+        ]
+
+        row_script(script, expected)
+    })
+
+    it('exports the table as csv and binary', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const csv_file = new_db + '.csv'
+        const binary_file = new_db + '.bin'
+        const script = [
+            'insert 1 user1 person1@example.com',
+            'insert 2 a,b say"hi"@example.com',
+            `.export ${csv_file} csv`,
+            `.export ${binary_file} binary`,
+            '.exit'
+        ]
+
+        db_session(new_db, [], script, async (output) => {
+            expect(output).to.eql([
+                'db > Executed .',
+                'db > Executed .',
+                'db > Exported 2 rows.',
+                'db > Exported 2 rows.',
+                'db > '
+            ])
+
+            // Fields with a separator or quote are quoted, quotes doubled.
+            expect(fs.readFileSync(csv_file, 'utf8')).to.eql(
+                'id,username,email\n' +
+                '1,user1,person1@example.com\n' +
+                '2,"a,b","say""hi""@example.com"\n'
+            )
+
+            // A magic and record size header, then every leaf cell as stored.
+            const cell_size = 297
+            const binary = fs.readFileSync(binary_file)
+            expect(binary.length).to.eql(8 + 2 * cell_size)
+            expect(binary.readUInt32LE(0)).to.eql(0x44425831)
+            expect(binary.readUInt32LE(4)).to.eql(cell_size)
+            expect(binary.readUInt32LE(8)).to.eql(1)
+            expect(binary.readUInt32LE(8 + cell_size)).to.eql(2)
+
+            await delete_db_after_test(new_db)
+            await delete_db_after_test(csv_file)
+            await delete_db_after_test(binary_file)
+            done()
+        })
+    })
+
+    it('backs up the table to a file that opens as a database', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const backup_file = new_db + '.bak'
+        const writer = exec(`./db_example ${new_db}`)
+
+        for (let value of [1, 2]) {
+            writer.stdin.write(`insert ${value} user${value} person${value}@example.com\n`)
+        }
+        writer.stdin.write(`.backup ${backup_file}\n`)
+        writer.stdin.write('.exit\n')
+
+        writer.on('exit', () => {
+            const reader = exec(`./db_example ${backup_file}`, async (error, stdout) => {
+                expect(stdout.split('\n')).to.eql([
+                    'db > (1, user1, person1@example.com)',
+                    '(2, user2, person2@example.com)',
+                    'Executed .',
+                    'db > '
+                ])
+                await delete_db_after_test(new_db)
+                await delete_db_after_test(backup_file)
+                done()
+            })
+            reader.stdin.write('select\n.exit\n')
+        })
+    })
+
+    it('rejects duplicates when the bloom filter is stale', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const session = (options, commands, callback) => {
+            const child = exec(`./db_example ${new_db} ${options}`, (error, stdout) => callback(stdout.split('\n')))
+            child.stdin.write(commands.join('\n') + '\n')
+        }
+
+        // The filter saved by the first session misses the key inserted by the second.
+        session('--bloom-filter', ['insert 1 user1 person1@example.com', '.exit'], () => {
+            session('', ['insert 2 user2 person2@example.com', '.exit'], () => {
+                session('--bloom-filter', [
+                    'insert 2 user2 person2@example.com',
+                    'insert values (1, user1, person1@example.com)',
+                    'select',
+                    '.exit'
+                ], async (output) => {
+                    expect(output).to.eql([
+                        'db > Error: Duplicate key.',
+                        'db > Error: Duplicate key.',
+                        'db > (1, user1, person1@example.com)',
+                        '(2, user2, person2@example.com)',
+                        'Executed .',
+                        'db > '
+                    ])
+                    await delete_db_after_test(new_db)
+                    await delete_db_after_test(new_db + '-bloom')
+                    done()
+                })
+            })
+        })
+    })
+
+    it('reads back rows written with direct I/O and huge pages', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const keys = Array(20).fill(1).map((_, i) => i + 1)
+        const row = (key) => `(${key}, user${key}, person${key}@example.com)`
+        const script = ['insert values ' + keys.map(row).join(', '), '.exit']
+
+        db_session(new_db, ['--direct-io', '--huge-pages'], script, (output) => {
+            expect(output).to.eql(['db > Executed .', 'db > '])
+
+            // Whole aligned pages written around the page cache must read back through it.
+            db_session(new_db, [], ['select', '.exit'], async (output) => {
+                expect(output).to.eql([
+                    `db > ${row(1)}`,
+                    ...keys.slice(1).map(row),
+                    'Executed .',
+                    'db > '
+                ])
+                await delete_db_after_test(new_db)
+                done()
+            })
+        })
+    })
+
+    it('replays a trace against a copy of the database', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const trace_file = new_db + '.trace'
+        const export_file = new_db + '.csv'
+        const backup_file = new_db + '.bak'
+        const script = [
+            'insert 1 user1 person1@example.com',
+            'insert 2 user2 person2@example.com',
+            'select',
+            `.export ${export_file}`,
+            `.backup ${backup_file}`,
+            '.exit'
+        ]
+
+        db_session(new_db, ['--trace', trace_file], script, () => {
+            // Removed before the replay, so the checks below see whether it wrote them again.
+            fs.unlinkSync(export_file)
+            fs.unlinkSync(backup_file)
+
+            exec(`./db_replay ${trace_file} ${new_db}`, async (error, stdout) => {
+                // Timings vary, compare the statement kinds and counts only.
+                const columns = stdout.split('\n').map((line) => line.split(/ +/).slice(0, 2).join(' '))
+                expect(columns).to.eql([
+                    'Replayed 3',
+                    'Recorded latency',
+                    'statement count',
+                    'insert 2',
+                    'select 1',
+                    'Replayed latency',
+                    'statement count',
+                    'insert 2',
+                    'select 1',
+                    ''
+                ])
+
+                // .export and .backup are not replayed, and the scratch copy is removed.
+                expect(fs.existsSync(export_file)).to.eql(false)
+                expect(fs.existsSync(backup_file)).to.eql(false)
+                expect(fs.existsSync(new_db + '-replay')).to.eql(false)
+
+                await delete_db_after_test(new_db)
+                await delete_db_after_test(trace_file)
+                done()
+            })
+        })
+    })
+
     it('allows printing out the structure of a one-node btree', function (){
         const script = [3, 1, 2].map((value) => `insert ${value} user${value} person${value}@example.com`)
         script.push('.btree')
@@ -199,16 +504,18 @@ describe('database-tests', function (){
         row_script(script, expected)
     });
 
-    it('allows printing out the structure of a 3-leaf-node tree', function () {
-        const arr = Array(14).fill(1).map((_,i) => `ìnsert ${i} user${i} person${i}@example.com`)
-        arr.push('.btree')
-        arr.push('insert 15 user15 person15@example.com')
-        arr.push('.exit')
+    it('keeps the left leaf full when splitting on sequential inserts', function () {
+        const script = Array(14).fill(1).map((_,i) => `insert ${i} user${i} person${i}@example.com`)
+        script.push('.btree')
+        script.push('insert 15 user15 person15@example.com')
+        script.push('.exit')
 
         const expected = [
+            ...Array(14).fill('db > Executed .'),
             'db > Tree:',
             '- internal (size 1)',
-            '  - leaf (size 7)',
+            '  - leaf (size 13)',
+            '    - 0',
             '    - 1',
             '    - 2',
             '    - 3',
@@ -216,18 +523,19 @@ describe('database-tests', function (){
             '    - 5',
             '    - 6',
             '    - 7',
-            '  - key 7',
-            '  - leaf (size 7)',
             '    - 8',
             '    - 9',
             '    - 10',
             '    - 11',
             '    - 12',
+            '  - key 12',
+            '  - leaf (size 1)',
             '    - 13',
-            '    - 14',
             'db > Executed .',
             'db > '
         ]
+
+        row_script(script, expected)
     })
 
     it('prints all rows in a multi-level tree ', function () {
@@ -255,4 +563,211 @@ describe('database-tests', function (){
 
         row_script(script, expected)
     })
-})
\ No newline at end of file
+
+    it('analyzes the tree after sequential inserts', function () {
+        const script = Array(45).fill(1).map((_, i) => `insert ${i + 1} user${i + 1} person${i + 1}@example.com`)
+        script.push('.analyze')
+        script.push('.exit')
+
+        const expected = Array(45).fill('db > Executed .')
+        expected.push(
+            'db > Analysis:',
+            'depth: 2',
+            'pages: 5 (4 leaf, 1 internal, 0 free)',
+            'level 0: 1 pages',
+            'level 1: 4 pages',
+            'leaf fill: 86.5% average, 45 cells',
+            ...histogram([0, 0, 0, 0, 1, 0, 0, 0, 0, 3]),
+            'internal fill: 100.0% average, 3 keys',
+            ...histogram([0, 0, 0, 0, 0, 0, 0, 0, 0, 1]),
+            'leaf chain: 1 of 3 links sequential (33.3%), 1.3 pages average distance',
+            'db > '
+        )
+
+        row_script(script, expected)
+    })
+
+    it('reorganizes randomly inserted rows into sequential leaves', function () {
+        const keys = Array(30).fill(1).map((_, i) => (i * 7) % 30 + 1)
+        const script = keys.map((key) => `insert ${key} user${key} person${key}@example.com`)
+        script.push('reorganize')
+        script.push('select')
+        script.push('reorganize fill 50')
+        script.push('.btree')
+        script.push('.analyze')
+        script.push('select order by id desc limit 8')
+        script.push('.exit')
+
+        const row = (key) => `(${key}, user${key}, person${key}@example.com)`
+        const leaf = (first) => [
+            '    - leaf (size 6)',
+            ...Array(6).fill(1).map((_, i) => `      - ${first + i}`)
+        ]
+        const expected = Array(31).fill('db > Executed .')
+        expected.push(
+            `db > ${row(1)}`,
+            ...Array(29).fill(1).map((_, i) => row(i + 2)),
+            'Executed .',
+            'db > Executed .',
+            'db > Tree:',
+            '- internal (size 1)',
+            '  - internal (size 2)',
+            ...leaf(1),
+            '    - key 6',
+            ...leaf(7),
+            '    - key 12',
+            ...leaf(13),
+            '  - key 18',
+            '  - internal (size 1)',
+            ...leaf(19),
+            '    - key 24',
+            ...leaf(25),
+            'db > Analysis:',
+            'depth: 3',
+            'pages: 8 (5 leaf, 3 internal, 0 free)',
+            'level 0: 1 pages',
+            'level 1: 2 pages',
+            'level 2: 5 pages',
+            'leaf fill: 46.2% average, 30 cells',
+            ...histogram([0, 0, 0, 0, 5, 0, 0, 0, 0, 0]),
+            'internal fill: 44.4% average, 4 keys',
+            ...histogram([0, 0, 0, 2, 0, 0, 1, 0, 0, 0]),
+            'leaf chain: 4 of 4 links sequential (100.0%), 1.0 pages average distance',
+            `db > ${row(30)}`,
+            ...Array(7).fill(1).map((_, i) => row(29 - i)),
+            'Executed .',
+            'db > '
+        )
+
+        row_script(script, expected)
+    })
+
+    it('rejects a reorganize fill outside 1-100', function () {
+        const script = [
+            'reorganize fill 0',
+            'reorganize fill 101',
+            'reorganize fill half',
+            '.exit'
+        ]
+
+        const expected = [
+            'db > Syntax error. Could not parse statement .',
+            'db > Syntax error. Could not parse statement .',
+            'db > Syntax error. Could not parse statement .',
+            'db > '
+        ]
+
+        row_script(script, expected)
+    })
+
+    it('serves statements over a unix socket', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const socket_path = new_db + '.sock'
+
+        const server = start_server(new_db, socket_path, () => {
+            const client = net.createConnection(socket_path)
+            read_frames(client, (responses) => {
+                if (responses.length == 2) {
+                    expect(responses).to.eql([
+                        'Executed .\n',
+                        '(1, user1, person1@example.com)\nExecuted .\n'
+                    ])
+                    client.end()
+                    send_and_half_close()
+                }
+            })
+
+            client.write(frame('insert 1 user1 person1@example.com'))
+            client.write(frame('select'))
+        })
+
+        // A one-shot client that shuts down its write side still gets its answer.
+        const send_and_half_close = () => {
+            const client = net.createConnection(socket_path)
+            const responses = read_frames(client, () => {})
+            client.on('end', () => {
+                expect(responses).to.eql(['Executed .\n'])
+                server.kill('SIGTERM')
+            })
+            client.end(frame('insert 2 user2 person2@example.com'))
+        }
+
+        server.on('exit', () => {
+            expect(fs.existsSync(socket_path)).to.eql(false)
+            db_session(new_db, [], ['select', '.exit'], async (output) => {
+                expect(output).to.eql([
+                    'db > (1, user1, person1@example.com)',
+                    '(2, user2, person2@example.com)',
+                    'Executed .',
+                    'db > '
+                ])
+                await delete_db_after_test(new_db)
+                await delete_db_after_test(socket_path)
+                done()
+            })
+        })
+    })
+
+    it('streams a backup over a unix socket while writes continue', function (done) {
+        const new_db = 'new_db_' + Date.now().valueOf() + '.db'
+        const socket_path = new_db + '.sock'
+        const backup_file = new_db + '.bak'
+
+        const server = start_server(new_db, socket_path, () => {
+            const client = net.createConnection(socket_path)
+            read_frames(client, (responses) => {
+                if (responses.length < 4) {
+                    return
+                }
+                if (responses.length == 4) {
+                    expect(responses).to.eql([
+                        'Executed .\n',
+                        'Backup started.\n',
+                        'Executed .\n',
+                        'Executed .\n'
+                    ])
+                }
+
+                // Poll until the server loop has streamed every page.
+                const status = responses[responses.length - 1]
+                if (status == `Backup to ${backup_file} complete.\n`) {
+                    client.end()
+                    server.kill('SIGTERM')
+                } else {
+                    client.write(frame('.backup status'))
+                }
+            })
+
+            client.write(frame('insert values (1, user1, person1@example.com), (2, user2, person2@example.com)'))
+            client.write(frame(`.backup ${backup_file}`))
+            client.write(frame('insert 3 user3 person3@example.com'))
+            client.write(frame('update set username=changed where id = 1'))
+        })
+
+        server.on('exit', () => {
+            // The backup holds the table as it was when .backup arrived,
+            // the live database everything written after it.
+            db_session(backup_file, [], ['select', '.exit'], (backup_output) => {
+                expect(backup_output).to.eql([
+                    'db > (1, user1, person1@example.com)',
+                    '(2, user2, person2@example.com)',
+                    'Executed .',
+                    'db > '
+                ])
+                db_session(new_db, [], ['select', '.exit'], async (live_output) => {
+                    expect(live_output).to.eql([
+                        'db > (1, changed, person1@example.com)',
+                        '(2, user2, person2@example.com)',
+                        '(3, user3, person3@example.com)',
+                        'Executed .',
+                        'db > '
+                    ])
+                    await delete_db_after_test(new_db)
+                    await delete_db_after_test(backup_file)
+                    await delete_db_after_test(socket_path)
+                    done()
+                })
+            })
+        })
+    })
+})
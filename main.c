@@ -1,3 +1,5 @@
+// O_DIRECT is a GNU extension, glibc hides it under strict -std=c11.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,12 +7,25 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0) -> Attribute)
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
-const uint32_t TABLE_MAX_PAGES = 100;
+#define TABLE_MAX_PAGES 100
 
 
 typedef struct {
@@ -37,17 +52,32 @@ typedef enum {
 } PrepareResult;
 
 typedef enum {
-    STATEMENT_INSERT, STATEMENT_SELECT
+    STATEMENT_INSERT, STATEMENT_INSERT_BATCH, STATEMENT_SELECT, STATEMENT_UPDATE, STATEMENT_REORGANIZE
 } StatementType;
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL, EXECUTE_DUPLICATE_KEY } ExecuteResult;
+typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL, EXECUTE_DUPLICATE_KEY, EXECUTE_IO_ERROR } ExecuteResult;
 
 typedef enum {NODE_LEAF, NODE_INTERNAL} NodeType;
 
+typedef enum { EXPORT_CSV, EXPORT_BINARY } ExportFormat;
+
 typedef struct {
     StatementType type;
     Row row_to_insert;
+    Row *rows_to_insert; // Owned by the statement, only set for STATEMENT_INSERT_BATCH
+    uint32_t num_rows_to_insert;
+    bool descending; // select ... order by id desc
+    uint32_t limit; // select ... limit n, SELECT_NO_LIMIT when absent
+    Row row_to_update; // New column values, id is unused
+    bool update_username;
+    bool update_email;
+    uint32_t min_key; // Inclusive key range matched by the where clause
+    uint32_t max_key;
+    bool empty_range;
+    uint32_t fill_percent; // reorganize fill <percent>
 } Statement;
 
+const uint32_t SELECT_NO_LIMIT = UINT32_MAX;
+
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
 const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
 const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
@@ -73,7 +103,10 @@ const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_PREV_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_PREV_LEAF_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE
+                                       + LEAF_NODE_PREV_LEAF_SIZE;
 
 
 // Leaf Node Body Layout
@@ -86,6 +119,9 @@ const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
 const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+// Splitting the rightmost leaf on an append keeps the old node full.
+const uint32_t LEAF_NODE_APPEND_RIGHT_SPLIT_COUNT = 1;
+const uint32_t LEAF_NODE_APPEND_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_APPEND_RIGHT_SPLIT_COUNT;
 
 // Internal node header layout
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
@@ -101,30 +137,147 @@ const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 const uint32_t INTERNAL_NODE_MAX_CELLS= 3;
 
+#define TREE_MAX_DEPTH 16
+#define FILL_HISTOGRAM_BUCKETS 10
+
+// Aggregate shape of the tree collected by .analyze
+typedef struct {
+    uint32_t depth;
+    uint32_t pages_per_level[TREE_MAX_DEPTH];
+    uint32_t num_leaves;
+    uint32_t num_internal;
+    uint64_t leaf_cells;
+    uint64_t internal_keys;
+    uint32_t leaf_fill_histogram[FILL_HISTOGRAM_BUCKETS];
+    uint32_t internal_fill_histogram[FILL_HISTOGRAM_BUCKETS];
+    bool reachable[TABLE_MAX_PAGES];
+} TreeStats;
+
+// Pager Open Flags
+const uint32_t PAGER_DIRECT_IO = 1 << 0;  // Bypass the kernel page cache with O_DIRECT
+const uint32_t PAGER_HUGE_PAGES = 1 << 1; // Carve page frames out of a huge page backed arena
+
+// O_DIRECT needs buffers, offsets and sizes aligned to the logical block size.
+// PAGE_SIZE is a multiple of every common block size, so frames are aligned to it.
+const uint32_t PAGER_FRAME_ALIGNMENT = 4096;
+const size_t PAGER_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+typedef struct Snapshot Snapshot;
+
 typedef struct {
     int file_descriptor;
+    char *filename;
     uint32_t file_length;
     uint32_t num_pages;
+    uint32_t flags;
+    void *frame_arena; // Backing memory for every frame when PAGER_HUGE_PAGES is set
+    size_t frame_arena_size;
     void *pages[TABLE_MAX_PAGES];
+    bool dirty[TABLE_MAX_PAGES]; // Only dirty pages are written back on close
+    Snapshot *snapshots; // Open snapshots, each copies a page before its first change
 } Pager;
 
+// Bloom filter over primary keys, persisted next to the database file.
+// A clear bit proves a key is absent, so inserts can skip the duplicate check
+// and point lookups can return without touching the tree.
+#define BLOOM_FILTER_SIZE 4096 // Bytes, sized for far more keys than TABLE_MAX_PAGES can hold
+const uint32_t BLOOM_FILTER_NUM_HASHES = 6;
+const uint32_t BLOOM_FILTER_MAGIC = 0x424c4f4d;
+
+typedef struct {
+    uint8_t bits[BLOOM_FILTER_SIZE];
+    char *path; // Sidecar file, the database filename with a -bloom suffix
+} BloomFilter;
+
+// The filter is only trusted if the database file still has the size and
+// modification time it had when the filter was saved.
+typedef struct {
+    uint32_t magic;
+    uint32_t num_hashes;
+    int64_t db_file_size;
+    int64_t db_mtime_sec;
+    int64_t db_mtime_nsec;
+} BloomFilterHeader;
+
 typedef struct {
     uint32_t num_rows;
     Pager* pager;
     uint32_t root_page_num;
+    uint32_t rightmost_leaf_page_num; // Cached so sequential appends skip the descent
+    BloomFilter *bloom_filter; // NULL unless opened with --bloom-filter
+    struct Backup *backup; // In-progress .backup while serving, NULL otherwise
+    char *last_backup_path; // Target of the last finished .backup, NULL if none ran
+    bool last_backup_complete;
+    bool serving; // Long running meta commands yield to the server loop
+    struct Trace *trace; // NULL unless started with --trace
 } Table;
 
+// A frozen view of the tree. Pages are shared with the pager until the pager
+// is about to change one, at which point the snapshot keeps a private copy
+// of the old contents. Readers of the snapshot never block writers.
+struct Snapshot {
+    Pager *pager;
+    uint32_t root_page_num;
+    uint32_t num_pages;
+    void *pages[TABLE_MAX_PAGES]; // Private copies, NULL while shared with the pager
+    Snapshot *next;
+};
+
+// Streams a snapshot's pages to a file a few pages at a time.
+typedef struct Backup {
+    Snapshot *snapshot;
+    int file_descriptor;
+    uint32_t next_page_num;
+    char *path;
+} Backup;
+
+const uint32_t BACKUP_PAGES_PER_STEP = 16;
+
+// Leaves are repacked to this share of LEAF_NODE_MAX_CELLS, leaving room
+// for a few inserts before the first split.
+const uint32_t REORGANIZE_DEFAULT_FILL_PERCENT = 90;
+
+// Workload trace, a header followed by one record per line of input:
+// arrival time and execution time in nanoseconds since the trace started,
+// the statement length and the statement bytes. Integers are host byte order.
+typedef struct Trace {
+    FILE *file;
+    uint64_t start_ns;
+} Trace;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} TraceHeader;
+
+const uint32_t TRACE_MAGIC = 0x44425452;
+const uint32_t TRACE_VERSION = 1;
+
 
 typedef struct {
     Table *table;
     uint32_t page_num;
     uint32_t cell_num;
-    bool end_of_table; // Indicates a position one past the last element
+    bool end_of_table; // Indicates a position past the last element in the direction of travel
 } Cursor;
 
 void* get_page(Pager* pager, uint32_t page_num);
+void pager_mark_dirty(Pager* pager, uint32_t page_num);
+Snapshot* snapshot_open(Table* table);
+void* snapshot_get_page(Snapshot* snapshot, uint32_t page_num);
+void snapshot_close(Snapshot* snapshot);
+Backup* backup_start(Table* table, const char* path);
+bool backup_step(Backup* backup);
+bool backup_finish(Backup* backup);
+bool table_finish_backup(Table* table);
+Cursor *table_seek(Table* table, uint32_t key);
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement *statement);
+ExecuteResult execute_update(Statement* statement, Table* table);
 Cursor *table_start(Table* table);
 void cursor_advance(Cursor* cursor);
+void cursor_retreat(Cursor* cursor);
+Cursor *table_end(Table* table);
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement *statement);
 InputBuffer * new_input_buffer();
 void print_prompt();
 void read_input(InputBuffer* input_buffer);
@@ -132,25 +285,42 @@ void close_input_buffer(InputBuffer* input_buffer);
 void pager_flush(Pager *pager, uint32_t page_num);
 void db_close(Table*table);
 MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table *table);
+int64_t table_export(Table* table, int fd, ExportFormat format);
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement *statement);
+PrepareResult prepare_insert_values(InputBuffer* input_buffer, Statement *statement);
+PrepareResult prepare_row(char *id_string, char *username, char *email, Row *row);
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement);
 void serialize_row(Row* source, void *destination);
 void deserialize_row(void *source, Row* destination);
 void* cursor_value(Cursor* cursor);
 ExecuteResult execute_insert(Statement* statement, Table* table);
+ExecuteResult execute_insert_batch(Statement* statement, Table* table);
+ExecuteResult table_insert_batch(Table* table, Row* rows, uint32_t num_rows);
 void print_row(Row* row);
 ExecuteResult execute_select(Statement *statement, Table *table );
 ExecuteResult execute_statement(Statement* statement, Table *table);
-Pager * pager_open(const char* filename);
-Table* db_open(const char* filename);
+Pager * pager_open(const char* filename, uint32_t flags);
+int pager_open_file(const char* filename, int open_flags, uint32_t flags);
+PrepareResult prepare_reorganize(InputBuffer* input_buffer, Statement *statement);
+ExecuteResult execute_reorganize(Statement* statement, Table* table);
+Table* db_open(const char* filename, uint32_t pager_flags, bool use_bloom_filter);
+BloomFilter* bloom_filter_open(Table* table, const char* db_filename);
+void bloom_filter_close(BloomFilter* filter, int db_file_descriptor);
+void bloom_filter_add(BloomFilter* filter, uint32_t key);
+bool bloom_filter_may_contain(BloomFilter* filter, uint32_t key);
+void* pager_allocate_frame(Pager* pager, uint32_t page_num);
+void pager_free_frame(Pager* pager, uint32_t page_num);
 uint32_t* leaf_node_num_cells(void *node);
 void* leaf_node_cell(void *node, uint32_t cell_num);
 uint32_t* leaf_node_key(void *node, uint32_t cell_num);
 void* leaf_node_value(void* node, uint32_t cell_num);
 void initialize_leaf_node(void *node);
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
+void leaf_node_merge(void *node, Row* rows, uint32_t num_rows);
 void print_constants();
 Cursor* table_find(Table* table, uint32_t key);
+Cursor* table_find_append(Table* table, uint32_t key);
+uint32_t table_rightmost_leaf(Table* table);
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
 NodeType get_node_type(void *node);
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
@@ -167,12 +337,20 @@ void set_node_root(void *node, int is_root);
 void initialize_internal_node(void *node);
 void indent(uint32_t level);
 void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level);
+void analyze_tree(Table *table);
 Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
 uint32_t* leaf_node_next_leaf(void *node);
+uint32_t* leaf_node_prev_leaf(void *node);
 uint32_t* node_parent(void *node);
 void update_internal_node_key(void*node, uint32_t old_key, uint32_t new_key);
 uint32_t internal_node_find_child(void *node, uint32_t key);
 void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+void process_input(InputBuffer* input_buffer, Table* table, uint64_t arrival_ns);
+void run_input(InputBuffer* input_buffer, Table* table);
+Trace* trace_open(const char* path);
+void trace_close(Trace* trace);
+uint64_t monotonic_ns();
+int server_run(const char* socket_path, Table* table);
 
 Cursor *table_start(Table* table){
     Cursor* cursor = table_find(table, 0);
@@ -184,6 +362,42 @@ Cursor *table_start(Table* table){
     return cursor;
 }
 
+// Return a cursor at the first row whose key is not less than the given key.
+Cursor *table_seek(Table* table, uint32_t key){
+    Cursor* cursor = table_find(table, key);
+    void *node = get_page(table -> pager, cursor -> page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    cursor -> end_of_table = false;
+
+    if (cursor -> cell_num >= num_cells){
+        // Key sorts after this leaf, continue at the start of the next one
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0){
+            cursor -> end_of_table = true;
+        } else {
+            cursor -> page_num = next_page_num;
+            cursor -> cell_num = 0;
+        }
+    }
+
+    return cursor;
+}
+
+// Return a cursor at the last row of the table, for walking backwards.
+Cursor *table_end(Table* table){
+    uint32_t page_num = table -> rightmost_leaf_page_num;
+    void *node = get_page(table -> pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    Cursor* cursor = malloc(sizeof(Cursor));
+    cursor -> table = table;
+    cursor -> page_num = page_num;
+    cursor -> cell_num = num_cells == 0 ? 0 : num_cells - 1;
+    cursor -> end_of_table = (num_cells == 0);
+
+    return cursor;
+}
+
 uint32_t internal_node_find_child(void *node, uint32_t key){
     // Return the index of the child which should contain the given key.
 
@@ -196,7 +410,7 @@ uint32_t internal_node_find_child(void *node, uint32_t key){
         uint32_t index = (min_index + max_index) / 2;
         uint32_t key_to_right = *internal_node_key(node, index);
         if (key_to_right >= key){
-            max_index = key;
+            max_index = index;
         } else {
             min_index = index + 1;
         }
@@ -233,6 +447,41 @@ Cursor *table_find(Table* table, uint32_t key){
     }
 }
 
+// Return the page number of the rightmost leaf by following right children
+// down from the root.
+uint32_t table_rightmost_leaf(Table* table){
+    uint32_t page_num = table -> root_page_num;
+    void *node = get_page(table -> pager, page_num);
+
+    while (get_node_type(node) == NODE_INTERNAL){
+        page_num = *internal_node_right_child(node);
+        node = get_page(table -> pager, page_num);
+    }
+
+    return page_num;
+}
+
+// If the key sorts after every key in the table, return a cursor one past the
+// last cell of the cached rightmost leaf without descending the tree.
+// Otherwise return NULL and the caller falls back to table_find.
+Cursor* table_find_append(Table* table, uint32_t key){
+    uint32_t page_num = table -> rightmost_leaf_page_num;
+    void *node = get_page(table -> pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    if (num_cells > 0 && key <= *leaf_node_key(node, num_cells - 1)){
+        return NULL;
+    }
+
+    Cursor* cursor = malloc(sizeof(Cursor));
+    cursor -> table = table;
+    cursor -> page_num = page_num;
+    cursor -> cell_num = num_cells;
+    cursor -> end_of_table = true;
+
+    return cursor;
+}
+
 uint32_t get_unused_page_num(Pager* pager){
     return pager -> num_pages;
 }
@@ -254,6 +503,25 @@ void cursor_advance(Cursor* cursor){
     }
 }
 
+void cursor_retreat(Cursor* cursor){
+    if (cursor -> cell_num > 0){
+        cursor -> cell_num -= 1;
+        return;
+    }
+
+    // Step back to previous leaf node
+    void *node = get_page(cursor -> table -> pager, cursor -> page_num);
+    uint32_t prev_page_num = *leaf_node_prev_leaf(node);
+    if (prev_page_num == 0){
+        // This was leftmost leaf
+        cursor -> end_of_table = true;
+    } else {
+        void *prev_node = get_page(cursor -> table -> pager, prev_page_num);
+        cursor -> page_num = prev_page_num;
+        cursor -> cell_num = *leaf_node_num_cells(prev_node) - 1;
+    }
+}
+
 InputBuffer * new_input_buffer(){
     InputBuffer * inputBuffer = (InputBuffer*) malloc(sizeof(InputBuffer));
     inputBuffer -> buffer = NULL;
@@ -273,11 +541,18 @@ void create_new_root(Table *table, uint32_t right_child_page_num){
     void *right_child = get_page(table -> pager, right_child_page_num);
     uint32_t left_child_page_num = get_unused_page_num(table -> pager);
     void *left_child = get_page(table -> pager, left_child_page_num);
+    pager_mark_dirty(table -> pager, table -> root_page_num);
+    pager_mark_dirty(table -> pager, left_child_page_num);
 
     // Left child has data copied from old root.
 
     memcpy(left_child, root, PAGE_SIZE);
     set_node_root(left_child, 0);
+    if (get_node_type(left_child) == NODE_LEAF && *leaf_node_next_leaf(left_child) != 0){
+        void *sibling = get_page(table -> pager, *leaf_node_next_leaf(left_child));
+        pager_mark_dirty(table -> pager, *leaf_node_next_leaf(left_child));
+        *leaf_node_prev_leaf(sibling) = left_child_page_num;
+    }
 
     // Root node is a new internal node with one key and two children.
     initialize_internal_node(root);
@@ -330,6 +605,109 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level){
     }
 }
 
+void analyze_node(Pager *pager, uint32_t page_num, uint32_t level, TreeStats *stats){
+    void *node = get_page(pager, page_num);
+    stats -> reachable[page_num] = true;
+    stats -> pages_per_level[level] += 1;
+    if (level + 1 > stats -> depth){
+        stats -> depth = level + 1;
+    }
+
+    uint32_t num_keys, bucket;
+    switch (get_node_type(node)) {
+        case NODE_LEAF:
+            num_keys = *leaf_node_num_cells(node);
+            stats -> num_leaves += 1;
+            stats -> leaf_cells += num_keys;
+            bucket = num_keys * FILL_HISTOGRAM_BUCKETS / LEAF_NODE_MAX_CELLS;
+            stats -> leaf_fill_histogram[bucket < FILL_HISTOGRAM_BUCKETS ? bucket : FILL_HISTOGRAM_BUCKETS - 1] += 1;
+            break;
+        case NODE_INTERNAL:
+            num_keys = *internal_node_num_keys(node);
+            stats -> num_internal += 1;
+            stats -> internal_keys += num_keys;
+            bucket = num_keys * FILL_HISTOGRAM_BUCKETS / INTERNAL_NODE_MAX_CELLS;
+            stats -> internal_fill_histogram[bucket < FILL_HISTOGRAM_BUCKETS ? bucket : FILL_HISTOGRAM_BUCKETS - 1] += 1;
+
+            if (level + 1 < TREE_MAX_DEPTH){
+                for (uint32_t i = 0; i <= num_keys; i++){
+                    analyze_node(pager, *internal_node_child(node, i), level + 1, stats);
+                }
+            }
+            break;
+    }
+}
+
+void print_fill_histogram(uint32_t *histogram){
+    for (uint32_t i = 0; i < FILL_HISTOGRAM_BUCKETS; i++){
+        uint32_t low = i * 100 / FILL_HISTOGRAM_BUCKETS;
+        uint32_t high = (i + 1) * 100 / FILL_HISTOGRAM_BUCKETS;
+        printf("  %3d-%3d%%: %d\n", low, high, histogram[i]);
+    }
+}
+
+// Walk the tree once and report its depth, fill factor, free pages and
+// how far apart logically adjacent leaves are in the file.
+void analyze_tree(Table *table){
+    Pager *pager = table -> pager;
+    TreeStats stats;
+    memset(&stats, 0, sizeof(stats));
+    analyze_node(pager, table -> root_page_num, 0, &stats);
+
+    uint32_t num_free = 0;
+    for (uint32_t i = 0; i < pager -> num_pages; i++){
+        if (!stats.reachable[i]){
+            num_free++;
+        }
+    }
+
+    printf("depth: %d\n", stats.depth);
+    printf("pages: %d (%d leaf, %d internal, %d free)\n",
+           pager -> num_pages, stats.num_leaves, stats.num_internal, num_free);
+    for (uint32_t level = 0; level < stats.depth; level++){
+        printf("level %d: %d pages\n", level, stats.pages_per_level[level]);
+    }
+
+    printf("leaf fill: %.1f%% average, %llu cells\n",
+           100.0 * stats.leaf_cells / ((double) stats.num_leaves * LEAF_NODE_MAX_CELLS),
+           (unsigned long long) stats.leaf_cells);
+    print_fill_histogram(stats.leaf_fill_histogram);
+    if (stats.num_internal > 0){
+        printf("internal fill: %.1f%% average, %llu keys\n",
+               100.0 * stats.internal_keys / ((double) stats.num_internal * INTERNAL_NODE_MAX_CELLS),
+               (unsigned long long) stats.internal_keys);
+        print_fill_histogram(stats.internal_fill_histogram);
+    }
+
+    // Follow the leaf chain, a link is sequential if the next leaf is the next page in the file.
+    Cursor *cursor = table_start(table);
+    uint32_t page_num = cursor -> page_num;
+    free(cursor);
+
+    uint32_t num_links = 0;
+    uint32_t num_sequential = 0;
+    uint64_t total_distance = 0;
+    uint32_t next_page_num = *leaf_node_next_leaf(get_page(pager, page_num));
+    while (next_page_num != 0){
+        num_links++;
+        if (next_page_num == page_num + 1){
+            num_sequential++;
+        }
+        total_distance += next_page_num > page_num ? next_page_num - page_num : page_num - next_page_num;
+
+        page_num = next_page_num;
+        next_page_num = *leaf_node_next_leaf(get_page(pager, page_num));
+    }
+
+    if (num_links > 0){
+        printf("leaf chain: %d of %d links sequential (%.1f%%), %.1f pages average distance\n",
+               num_sequential, num_links, 100.0 * num_sequential / num_links,
+               (double) total_distance / num_links);
+    } else {
+        printf("leaf chain: single leaf\n");
+    }
+}
+
 void read_input(InputBuffer* input_buffer){
     ssize_t bytes_read =
             getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
@@ -370,13 +748,23 @@ void pager_flush(Pager *pager, uint32_t page_num){
 
 void db_close(Table*table){
     Pager *pager = table->pager;
+    if (table -> backup){
+        // Pages must not be freed under a running backup, finish it first.
+        table_finish_backup(table);
+    }
+    free(table -> last_backup_path);
+    if (table -> trace){
+        trace_close(table -> trace);
+    }
+
     for (uint32_t i = 0; i < pager -> num_pages; i++){
         if (pager -> pages[i] == NULL){
             continue;
         }
-        pager_flush(pager, i);
-        free(pager -> pages[i]);
-        pager -> pages[i] = NULL;
+        if (pager -> dirty[i]){
+            pager_flush(pager, i);
+        }
+        pager_free_frame(pager, i);
     }
 
 //    uint32_t num_additional_rows = table -> num_rows % ROWS_PER_PAGE;
@@ -388,20 +776,27 @@ void db_close(Table*table){
 //            pager -> pages[page_num] = NULL;
 //        }
 //    }
-    int result = close(pager -> file_length);
+    if (table -> bloom_filter){
+        // Saved after the pages so it records the final state of the file.
+        bloom_filter_close(table -> bloom_filter, pager -> file_descriptor);
+    }
+
+    int result = close(pager -> file_descriptor);
     if (result == -1){
         printf("Error closing db file.\n");
         exit(EXIT_FAILURE);
     }
 
     for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
-        void* page = pager -> pages[i];
-        if (page){
-            free(page);
-            pager -> pages[i] = NULL;
+        if (pager -> pages[i]){
+            pager_free_frame(pager, i);
         }
     }
 
+    if (pager -> frame_arena){
+        munmap(pager -> frame_arena, pager -> frame_arena_size);
+    }
+    free(pager -> filename);
     free(pager);
     free(table);
 }
@@ -419,19 +814,81 @@ MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table *table){
         printf("Tree:\n");
         print_tree(table -> pager, 0, 0);
         return META_COMMAND_SUCCESS;
+    } else if(strcmp(input_buffer -> buffer, ".analyze") == 0){
+        printf("Analysis:\n");
+        analyze_tree(table);
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(input_buffer -> buffer, ".backup status") == 0){
+        if (table -> backup){
+            printf("Backup to %s running, %d of %d pages written.\n", table -> backup -> path,
+                   table -> backup -> next_page_num, table -> backup -> snapshot -> num_pages);
+        } else if (table -> last_backup_path){
+            printf(table -> last_backup_complete ? "Backup to %s complete.\n" : "Backup to %s failed.\n",
+                   table -> last_backup_path);
+        } else {
+            printf("No backup has run.\n");
+        }
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(input_buffer -> buffer, ".backup ", 8) == 0){
+        // .backup <file>
+        strtok(input_buffer -> buffer, " ");
+        char *path = strtok(NULL, " ");
+        if (table -> backup){
+            printf("A backup is already running\n");
+            return META_COMMAND_SUCCESS;
+        }
+
+        Backup *backup = backup_start(table, path);
+        if (backup == NULL){
+            printf("Unable to open backup file\n");
+        } else if (table -> serving){
+            // The server loop streams it between requests, clients poll .backup status.
+            table -> backup = backup;
+            printf("Backup started.\n");
+        } else {
+            uint32_t num_pages = backup -> snapshot -> num_pages;
+            table -> backup = backup;
+            if (table_finish_backup(table)){
+                printf("Backed up %d pages.\n", num_pages);
+            } else {
+                printf("Error writing backup file: %d\n", errno);
+            }
+        }
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(input_buffer -> buffer, ".export ", 8) == 0){
+        // .export <file> [csv|binary]
+        strtok(input_buffer -> buffer, " ");
+        char *path = strtok(NULL, " ");
+        char *format_name = strtok(NULL, " ");
+
+        ExportFormat format = EXPORT_CSV;
+        if (format_name != NULL && strcmp(format_name, "binary") == 0){
+            format = EXPORT_BINARY;
+        } else if (format_name != NULL && strcmp(format_name, "csv") != 0){
+            printf("Unknown export format '%s'\n", format_name);
+            return META_COMMAND_SUCCESS;
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+        if (fd == -1){
+            printf("Unable to open export file\n");
+            return META_COMMAND_SUCCESS;
+        }
+        int64_t num_rows = table_export(table, fd, format);
+        close(fd);
+
+        if (num_rows == -1){
+            printf("Error writing export file: %d\n", errno);
+        } else {
+            printf("Exported %lld rows.\n", (long long) num_rows);
+        }
+        return META_COMMAND_SUCCESS;
     } else {
         return META_UNRECOGNIZED_COMMAND;
     }
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement *statement){
-    statement->type = STATEMENT_INSERT;
-
-    char *keyword = strtok(input_buffer -> buffer, " ");
-    char *id_string = strtok(NULL, " ");
-    char *username = strtok(NULL, " ");
-    char *email = strtok(NULL, " ");
-
+PrepareResult prepare_row(char *id_string, char *username, char *email, Row *row){
     if (id_string == NULL || username == NULL || email == NULL){
         return PREPARE_SYNTAX_ERROR;
     }
@@ -450,21 +907,267 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement *statement){
         return PREPARE_STRING_TOO_LONG;
     }
 
-    statement -> row_to_insert.id = id;
-    strcpy(statement -> row_to_insert.username, username);
-    strcpy(statement -> row_to_insert.email, email);
+    row -> id = id;
+    strcpy(row -> username, username);
+    strcpy(row -> email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement *statement){
+    statement->type = STATEMENT_INSERT;
+
+    char *keyword = strtok(input_buffer -> buffer, " ");
+    char *id_string = strtok(NULL, " ");
+    char *username = strtok(NULL, " ");
+    char *email = strtok(NULL, " ");
+
+    return prepare_row(id_string, username, email, &(statement -> row_to_insert));
+
+}
+
+// insert values (id, username, email), (id, username, email), ...
+PrepareResult prepare_insert_values(InputBuffer* input_buffer, Statement *statement){
+    statement -> type = STATEMENT_INSERT_BATCH;
+    statement -> rows_to_insert = NULL;
+    statement -> num_rows_to_insert = 0;
+
+    uint32_t capacity = 0;
+    char *position = input_buffer -> buffer + strlen("insert values");
+    PrepareResult result = PREPARE_SUCCESS;
+
+    while (result == PREPARE_SUCCESS){
+        position += strspn(position, " ");
+        char *close = strchr(position, ')');
+        if (*position != '(' || close == NULL){
+            result = PREPARE_SYNTAX_ERROR;
+            break;
+        }
+        *close = '\0';
+
+        if (statement -> num_rows_to_insert == capacity){
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            statement -> rows_to_insert = realloc(statement -> rows_to_insert, capacity * sizeof(Row));
+        }
+
+        char *id_string = strtok(position + 1, ", ");
+        char *username = strtok(NULL, ", ");
+        char *email = strtok(NULL, ", ");
+        if (strtok(NULL, ", ") != NULL){
+            result = PREPARE_SYNTAX_ERROR;
+            break;
+        }
+        result = prepare_row(id_string, username, email,
+                             &(statement -> rows_to_insert[statement -> num_rows_to_insert]));
+        statement -> num_rows_to_insert += 1;
+
+        position = close + 1;
+        position += strspn(position, " ");
+        if (*position == '\0'){
+            break;
+        } else if (*position == ','){
+            position += 1;
+        } else {
+            result = PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    if (result != PREPARE_SUCCESS){
+        free(statement -> rows_to_insert);
+        statement -> rows_to_insert = NULL;
+    }
+    return result;
+}
+
+// select [order by id [asc|desc]] [limit n]
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement *statement){
+    statement -> type = STATEMENT_SELECT;
+    statement -> descending = false;
+    statement -> limit = SELECT_NO_LIMIT;
+
+    char *keyword = strtok(input_buffer -> buffer, " ");
+    if (strcmp(keyword, "select") != 0){
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    char *token = strtok(NULL, " ");
+    if (token != NULL && strcmp(token, "order") == 0){
+        char *by = strtok(NULL, " ");
+        char *column = strtok(NULL, " ");
+        if (by == NULL || column == NULL || strcmp(by, "by") != 0 || strcmp(column, "id") != 0){
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        token = strtok(NULL, " ");
+        if (token != NULL && strcmp(token, "desc") == 0){
+            statement -> descending = true;
+            token = strtok(NULL, " ");
+        } else if (token != NULL && strcmp(token, "asc") == 0){
+            token = strtok(NULL, " ");
+        }
+    }
+
+    if (token != NULL && strcmp(token, "limit") == 0){
+        char *limit_string = strtok(NULL, " ");
+        if (limit_string == NULL){
+            return PREPARE_SYNTAX_ERROR;
+        }
+        int limit = atoi(limit_string);
+        if (limit < 0){
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement -> limit = limit;
+        token = strtok(NULL, " ");
+    }
+
+    if (token != NULL){
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+// update set username=<value> email=<value> [where id <op> <n> [and id <op> <n>]]
+// where <op> is one of = < <= > >=
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement *statement){
+    statement -> type = STATEMENT_UPDATE;
+    statement -> update_username = false;
+    statement -> update_email = false;
+    statement -> min_key = 0;
+    statement -> max_key = UINT32_MAX;
+    statement -> empty_range = false;
+
+    char *keyword = strtok(input_buffer -> buffer, " ");
+    char *set = strtok(NULL, " ");
+    if (strcmp(keyword, "update") != 0){
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    if (set == NULL || strcmp(set, "set") != 0){
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    char *token = strtok(NULL, " ,");
+    while (token != NULL && strcmp(token, "where") != 0){
+        char *value = strchr(token, '=');
+        if (value == NULL){
+            return PREPARE_SYNTAX_ERROR;
+        }
+        *value = '\0';
+        value += 1;
+
+        if (strcmp(token, "username") == 0){
+            if (strlen(value) > COLUMN_USERNAME_SIZE){
+                return PREPARE_STRING_TOO_LONG;
+            }
+            strcpy(statement -> row_to_update.username, value);
+            statement -> update_username = true;
+        } else if (strcmp(token, "email") == 0){
+            if (strlen(value) > COLUMN_EMAIL_SIZE){
+                return PREPARE_STRING_TOO_LONG;
+            }
+            strcpy(statement -> row_to_update.email, value);
+            statement -> update_email = true;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok(NULL, " ,");
+    }
+
+    if (!statement -> update_username && !statement -> update_email){
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (token == NULL){
+        return PREPARE_SUCCESS;
+    }
+
+    do {
+        char *column = strtok(NULL, " ");
+        char *operator = strtok(NULL, " ");
+        char *value_string = strtok(NULL, " ");
+        if (column == NULL || operator == NULL || value_string == NULL || strcmp(column, "id") != 0){
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        int value = atoi(value_string);
+        if (value < 0){
+            return PREPARE_NEGATIVE_ID;
+        }
+        uint32_t key = value;
+
+        if (strcmp(operator, "=") == 0){
+            statement -> min_key = key > statement -> min_key ? key : statement -> min_key;
+            statement -> max_key = key < statement -> max_key ? key : statement -> max_key;
+        } else if (strcmp(operator, ">=") == 0){
+            statement -> min_key = key > statement -> min_key ? key : statement -> min_key;
+        } else if (strcmp(operator, "<=") == 0){
+            statement -> max_key = key < statement -> max_key ? key : statement -> max_key;
+        } else if (strcmp(operator, ">") == 0){
+            if (key == UINT32_MAX){
+                statement -> empty_range = true;
+            } else if (key + 1 > statement -> min_key){
+                statement -> min_key = key + 1;
+            }
+        } else if (strcmp(operator, "<") == 0){
+            if (key == 0){
+                statement -> empty_range = true;
+            } else if (key - 1 < statement -> max_key){
+                statement -> max_key = key - 1;
+            }
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        token = strtok(NULL, " ");
+    } while (token != NULL && strcmp(token, "and") == 0);
 
+    if (token != NULL){
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (statement -> min_key > statement -> max_key){
+        statement -> empty_range = true;
+    }
     return PREPARE_SUCCESS;
+}
 
+// reorganize [fill <percent>]
+PrepareResult prepare_reorganize(InputBuffer* input_buffer, Statement *statement){
+    statement -> type = STATEMENT_REORGANIZE;
+    statement -> fill_percent = REORGANIZE_DEFAULT_FILL_PERCENT;
+
+    char *keyword = strtok(input_buffer -> buffer, " ");
+    if (strcmp(keyword, "reorganize") != 0){
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    char *token = strtok(NULL, " ");
+    if (token != NULL){
+        char *percent_string = strtok(NULL, " ");
+        if (strcmp(token, "fill") != 0 || percent_string == NULL || strtok(NULL, " ") != NULL){
+            return PREPARE_SYNTAX_ERROR;
+        }
+        int percent = atoi(percent_string);
+        if (percent < 1 || percent > 100){
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement -> fill_percent = percent;
+    }
+    return PREPARE_SUCCESS;
 }
 
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement){
+    if (strncmp(input_buffer -> buffer, "reorganize", 10) == 0){
+        return prepare_reorganize(input_buffer, statement);
+    }
+    if (strncmp(input_buffer -> buffer, "update", 6) == 0){
+        return prepare_update(input_buffer, statement);
+    }
+    if (strncmp(input_buffer -> buffer, "insert values", 13) == 0){
+        return prepare_insert_values(input_buffer, statement);
+    }
     if (strncmp(input_buffer -> buffer, "insert", 6) == 0){
         return prepare_insert(input_buffer, statement);
     }
-    if (strcmp(input_buffer-> buffer, "select") == 0){
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+    if (strncmp(input_buffer-> buffer, "select", 6) == 0){
+        return prepare_select(input_buffer, statement);
     }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
@@ -504,7 +1207,7 @@ void set_node_root(void*node, int is_root){
 }
 
 void* get_page(Pager* pager, uint32_t page_num){
-    if (page_num > TABLE_MAX_PAGES){
+    if (page_num >= TABLE_MAX_PAGES){
         printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
         exit(EXIT_FAILURE);
     }
@@ -513,12 +1216,15 @@ void* get_page(Pager* pager, uint32_t page_num){
         // Cache miss. Allocate memory and load from file.
         // We might save a partial page at the end of the file
 
-        void *page = malloc(PAGE_SIZE);
+        void *page = pager_allocate_frame(pager, page_num);
         uint32_t num_pages = pager-> file_length / PAGE_SIZE;
         if (pager -> file_length % PAGE_SIZE){
             num_pages+=1;
         }
 
+        // Pages past the end of the file are new and must be written on close.
+        pager -> dirty[page_num] = (page_num >= num_pages);
+
         if (page_num <= num_pages){
             lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
             ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
@@ -536,53 +1242,228 @@ void* get_page(Pager* pager, uint32_t page_num){
     return pager -> pages[page_num];
 }
 
+// Must be called before a page is modified, so open snapshots can keep the old contents.
+void pager_mark_dirty(Pager* pager, uint32_t page_num){
+    for (Snapshot *snapshot = pager -> snapshots; snapshot != NULL; snapshot = snapshot -> next){
+        if (page_num < snapshot -> num_pages && snapshot -> pages[page_num] == NULL){
+            snapshot -> pages[page_num] = malloc(PAGE_SIZE);
+            memcpy(snapshot -> pages[page_num], get_page(pager, page_num), PAGE_SIZE);
+        }
+    }
+    pager -> dirty[page_num] = true;
+}
+
 void* cursor_value(Cursor* cursor){
     uint32_t page_num = cursor -> page_num;
     void *page = get_page(cursor -> table -> pager, page_num);
     return leaf_node_value(page, cursor -> cell_num);
 }
 ExecuteResult execute_insert(Statement* statement, Table* table){
-    void *node = get_page(table -> pager, table -> root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
     Row *row_to_insert = &(statement->row_to_insert);
     uint32_t key_to_insert = row_to_insert -> id;
-    Cursor *cursor = table_find(table, key_to_insert);
 
+    Cursor *cursor = table_find_append(table, key_to_insert);
+    if (cursor == NULL){
+        cursor = table_find(table, key_to_insert);
+    }
+
+    void *node = get_page(table -> pager, cursor -> page_num);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
+
+    // The descent already landed on the insert position, so the duplicate check is a single compare.
     if (cursor -> cell_num < num_cells){
         uint32_t key_at_index = *leaf_node_key(node, cursor -> cell_num);
         if (key_at_index == key_to_insert){
+            free(cursor);
             return EXECUTE_DUPLICATE_KEY;
         }
     }
 
     leaf_node_insert(cursor, row_to_insert -> id, row_to_insert);
     free(cursor);
+    if (table -> bloom_filter){
+        bloom_filter_add(table -> bloom_filter, key_to_insert);
+    }
 
     return EXECUTE_SUCCESS;
 
 }
 
-NodeType get_node_type(void* node){
-    uint8_t value = *((uint8_t*) (node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+int compare_rows_by_id(const void *a, const void *b){
+    uint32_t a_id = ((const Row*) a) -> id;
+    uint32_t b_id = ((const Row*) b) -> id;
+    return (a_id > b_id) - (a_id < b_id);
 }
 
-void set_node_type(void *node, NodeType type){
-    uint8_t value = type;
-    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
-}
+// Count how many of the sorted rows belong to the leaf the cursor points into.
+// The first row was routed there by the caller. Later rows follow it if they do not
+// sort past the leaf's largest key, or if it is the rightmost leaf.
+uint32_t leaf_node_batch_group(Cursor* cursor, Row* rows, uint32_t num_rows){
+    void *node = get_page(cursor -> table -> pager, cursor -> page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (*leaf_node_next_leaf(node) == 0 || num_cells == 0){
+        return num_rows;
+    }
+
+    uint32_t max_key = *leaf_node_key(node, num_cells - 1);
+    uint32_t group = 1;
+    while (group < num_rows && rows[group].id <= max_key){
+        group++;
+    }
+    return group;
+}
+
+// Insert many rows at once. Rows are sorted by key and applied leaf by leaf:
+// a single descent finds each target leaf and the whole group is merged into it in one pass.
+// The batch is checked for duplicate keys before anything is written.
+ExecuteResult table_insert_batch(Table* table, Row* rows, uint32_t num_rows){
+    if (num_rows == 0){
+        return EXECUTE_SUCCESS;
+    }
+
+    qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+    for (uint32_t i = 1; i < num_rows; i++){
+        if (rows[i].id == rows[i - 1].id){
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    // Check against the table. A batch that starts past the largest key cannot collide,
+    // and neither can one whose keys the bloom filter has never seen.
+    bool may_collide = true;
+    if (table -> bloom_filter){
+        may_collide = false;
+        for (uint32_t j = 0; j < num_rows && !may_collide; j++){
+            may_collide = bloom_filter_may_contain(table -> bloom_filter, rows[j].id);
+        }
+    }
+
+    Cursor *cursor = may_collide ? table_find_append(table, rows[0].id) : NULL;
+    uint32_t i = may_collide ? 0 : num_rows;
+    while (cursor == NULL && i < num_rows){
+        cursor = table_find(table, rows[i].id);
+        void *node = get_page(table -> pager, cursor -> page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t group = leaf_node_batch_group(cursor, rows + i, num_rows - i);
+
+        uint32_t cell_num = cursor -> cell_num;
+        for (uint32_t j = i; j < i + group; j++){
+            while (cell_num < num_cells && *leaf_node_key(node, cell_num) < rows[j].id){
+                cell_num++;
+            }
+            if (cell_num < num_cells && *leaf_node_key(node, cell_num) == rows[j].id){
+                free(cursor);
+                return EXECUTE_DUPLICATE_KEY;
+            }
+        }
+
+        i += group;
+        free(cursor);
+        cursor = NULL;
+    }
+    free(cursor);
+
+    i = 0;
+    while (i < num_rows){
+        cursor = table_find_append(table, rows[i].id);
+        if (cursor == NULL){
+            cursor = table_find(table, rows[i].id);
+        }
+
+        void *node = get_page(table -> pager, cursor -> page_num);
+        uint32_t free_cells = LEAF_NODE_MAX_CELLS - *leaf_node_num_cells(node);
+
+        if (free_cells == 0){
+            // Leaf is full, split it once on the first row of its group and merge the
+            // rest of the group into the two halves without descending again.
+            uint32_t group = leaf_node_batch_group(cursor, rows + i, num_rows - i);
+            uint32_t right_page_num = get_unused_page_num(table -> pager);
+            leaf_node_insert(cursor, rows[i].id, &rows[i]);
+            i++;
+            group--;
+
+            // A root split moves the left half to a new page, the prev link always finds it.
+            void *right = get_page(table -> pager, right_page_num);
+            uint32_t left_page_num = *leaf_node_prev_leaf(right);
+            void *left = get_page(table -> pager, left_page_num);
+
+            // Keys up to the left half's max route left, the parent key stays valid.
+            uint32_t left_max_key = *leaf_node_key(left, *leaf_node_num_cells(left) - 1);
+            uint32_t left_rows = 0;
+            while (left_rows < group && rows[i + left_rows].id <= left_max_key){
+                left_rows++;
+            }
+
+            uint32_t left_free = LEAF_NODE_MAX_CELLS - *leaf_node_num_cells(left);
+            uint32_t left_count = left_rows < left_free ? left_rows : left_free;
+            if (left_count > 0){
+                pager_mark_dirty(table -> pager, left_page_num);
+                leaf_node_merge(left, rows + i, left_count);
+                i += left_count;
+            }
+
+            // Rows for the right half may only follow once the left half took all of its own.
+            if (left_count == left_rows){
+                uint32_t right_free = LEAF_NODE_MAX_CELLS - *leaf_node_num_cells(right);
+                uint32_t right_rows = group - left_rows;
+                uint32_t right_count = right_rows < right_free ? right_rows : right_free;
+                if (right_count > 0){
+                    pager_mark_dirty(table -> pager, right_page_num);
+                    leaf_node_merge(right, rows + i, right_count);
+                    i += right_count;
+                }
+            }
+        } else {
+            uint32_t group = leaf_node_batch_group(cursor, rows + i, num_rows - i);
+            uint32_t count = group < free_cells ? group : free_cells;
+            pager_mark_dirty(table -> pager, cursor -> page_num);
+            leaf_node_merge(node, rows + i, count);
+            i += count;
+        }
+
+        free(cursor);
+    }
+
+    if (table -> bloom_filter){
+        for (i = 0; i < num_rows; i++){
+            bloom_filter_add(table -> bloom_filter, rows[i].id);
+        }
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert_batch(Statement* statement, Table* table){
+    return table_insert_batch(table, statement -> rows_to_insert, statement -> num_rows_to_insert);
+}
+
+NodeType get_node_type(void* node){
+    uint8_t value = *((uint8_t*) (node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+void set_node_type(void *node, NodeType type){
+    uint8_t value = type;
+    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
 
 void print_row(Row* row) {
     printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 ExecuteResult execute_select(Statement *statement, Table *table ){
-    Cursor *cursor = table_start(table);
+    // Descending scans start at the rightmost leaf and only touch the rows they return.
+    Cursor *cursor = statement -> descending ? table_end(table) : table_start(table);
     Row row;
-    while(!(cursor -> end_of_table)){
+    uint32_t num_rows = 0;
+    while(!(cursor -> end_of_table) && num_rows < statement -> limit){
         deserialize_row(cursor_value(cursor), &row);
         print_row(&row);
-        cursor_advance(cursor);
+        num_rows++;
+        if (statement -> descending){
+            cursor_retreat(cursor);
+        } else {
+            cursor_advance(cursor);
+        }
     }
 
     free(cursor);
@@ -590,27 +1471,165 @@ ExecuteResult execute_select(Statement *statement, Table *table ){
 
 }
 
+// Overwrite the matching rows' values inside their leaf cells.
+// Keys do not change, so the tree is never restructured and only the touched leaves become dirty.
+ExecuteResult execute_update(Statement* statement, Table* table){
+    if (statement -> empty_range){
+        return EXECUTE_SUCCESS;
+    }
+    if (statement -> min_key == statement -> max_key && table -> bloom_filter
+        && !bloom_filter_may_contain(table -> bloom_filter, statement -> min_key)){
+        // Point update of a key that is not in the table
+        return EXECUTE_SUCCESS;
+    }
+
+    Cursor *cursor = table_seek(table, statement -> min_key);
+    while (!(cursor -> end_of_table)){
+        void *node = get_page(table -> pager, cursor -> page_num);
+        if (*leaf_node_key(node, cursor -> cell_num) > statement -> max_key){
+            break;
+        }
+
+        void *value = leaf_node_value(node, cursor -> cell_num);
+        pager_mark_dirty(table -> pager, cursor -> page_num);
+        if (statement -> update_username){
+            strncpy(value + USERNAME_OFFSET, statement -> row_to_update.username, USERNAME_SIZE);
+        }
+        if (statement -> update_email){
+            strncpy(value + EMAIL_OFFSET, statement -> row_to_update.email, EMAIL_SIZE);
+        }
+
+        cursor_advance(cursor);
+    }
+
+    free(cursor);
+    return EXECUTE_SUCCESS;
+}
+
 ExecuteResult execute_statement(Statement* statement, Table *table){
     switch (statement -> type) {
         case STATEMENT_INSERT:
             return execute_insert(statement, table);
+        case STATEMENT_INSERT_BATCH:
+            return execute_insert_batch(statement, table);
         case STATEMENT_SELECT:
             return execute_select(statement, table);
+        case STATEMENT_UPDATE:
+            return execute_update(statement, table);
+        case STATEMENT_REORGANIZE:
+            return execute_reorganize(statement, table);
+    }
+}
+
+// Return a page sized frame for the page. Frames are aligned for O_DIRECT
+// and come from the huge page arena when the pager has one.
+void* pager_allocate_frame(Pager* pager, uint32_t page_num){
+    if (pager -> frame_arena){
+        return pager -> frame_arena + (size_t) page_num * PAGE_SIZE;
     }
+
+    void *frame = NULL;
+    if (posix_memalign(&frame, PAGER_FRAME_ALIGNMENT, PAGE_SIZE) != 0){
+        printf("Unable to allocate page frame\n");
+        exit(EXIT_FAILURE);
+    }
+    return frame;
+}
+
+void pager_free_frame(Pager* pager, uint32_t page_num){
+    if (pager -> frame_arena == NULL){
+        free(pager -> pages[page_num]);
+    }
+    pager -> pages[page_num] = NULL;
 }
 
-Pager * pager_open(const char* filename){
-    int fd = open(filename, O_RDWR | O_CREAT | S_IWUSR | S_IRUSR);
+// Reserve one arena for all TABLE_MAX_PAGES frames, preferring explicit huge pages
+// and falling back to transparent huge pages if none are configured.
+void pager_map_frame_arena(Pager* pager){
+    size_t size = (size_t) TABLE_MAX_PAGES * PAGE_SIZE;
+    size = (size + PAGER_HUGE_PAGE_SIZE - 1) / PAGER_HUGE_PAGE_SIZE * PAGER_HUGE_PAGE_SIZE;
+
+    void *arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (arena == MAP_FAILED){
+        arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED){
+            printf("Unable to map page frames: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(arena, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    pager -> frame_arena = arena;
+    pager -> frame_arena_size = size;
+}
+
+// Open and lock a database file with the pager flags applied.
+// Returns -1 with errno set on failure, EWOULDBLOCK if another process holds the lock.
+int pager_open_file(const char* filename, int open_flags, uint32_t flags){
+#if defined(O_DIRECT)
+    if (flags & PAGER_DIRECT_IO){
+        open_flags |= O_DIRECT;
+    }
+#elif !defined(F_NOCACHE)
+    // No way to bypass the page cache here, refuse rather than silently buffer.
+    if (flags & PAGER_DIRECT_IO){
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
+    int fd = open(filename, open_flags, S_IWUSR | S_IRUSR);
     if (fd == -1){
-        printf("Unable to open file\n");
+        return -1;
+    }
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if ((flags & PAGER_DIRECT_IO) && fcntl(fd, F_NOCACHE, 1) == -1){
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+#endif
+
+    // Only one process may own the file, a second writer would corrupt it.
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1){
+        close(fd);
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    return fd;
+}
+
+Pager * pager_open(const char* filename, uint32_t flags){
+    int fd = pager_open_file(filename, O_RDWR | O_CREAT, flags);
+    if (fd == -1){
+        if (errno == EWOULDBLOCK){
+            printf("Database file is locked by another process\n");
+        } else if ((flags & PAGER_DIRECT_IO) && errno == ENOTSUP){
+            printf("Direct I/O is not supported on this platform\n");
+        } else if (flags & PAGER_DIRECT_IO){
+            printf("Unable to open file for direct I/O: %d\n", errno);
+        } else {
+            printf("Unable to open file\n");
+        }
         exit(EXIT_FAILURE);
     }
 
     off_t file_length = lseek(fd, 0, SEEK_END);
     Pager* pager = malloc(sizeof(Pager));
     pager -> file_descriptor = fd;
+    pager -> filename = strdup(filename);
     pager -> file_length = file_length;
     pager -> num_pages = (file_length / PAGE_SIZE);
+    pager -> flags = flags;
+    pager -> frame_arena = NULL;
+    pager -> frame_arena_size = 0;
 
     if (file_length % PAGE_SIZE % PAGE_SIZE != 0){
         printf("Db file is not a whole number of pages. Corrupt file.\n");
@@ -619,14 +1638,20 @@ Pager * pager_open(const char* filename){
 
     for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
         pager->pages[i] = NULL;
+        pager->dirty[i] = false;
+    }
+    pager -> snapshots = NULL;
+
+    if (flags & PAGER_HUGE_PAGES){
+        pager_map_frame_arena(pager);
     }
 
     return pager;
 }
 
-Table* db_open(const char* filename) {
+Table* db_open(const char* filename, uint32_t pager_flags, bool use_bloom_filter) {
 
-    Pager* pager = pager_open(filename);
+    Pager* pager = pager_open(filename, pager_flags);
     Table *table = malloc(sizeof(Table));
     table -> pager = pager;
     table -> root_page_num = 0;
@@ -636,9 +1661,122 @@ Table* db_open(const char* filename) {
         initialize_leaf_node(root_node);
         set_node_root(root_node, 1);
     }
+    table -> rightmost_leaf_page_num = table_rightmost_leaf(table);
+    table -> bloom_filter = use_bloom_filter ? bloom_filter_open(table, filename) : NULL;
+    table -> backup = NULL;
+    table -> last_backup_path = NULL;
+    table -> last_backup_complete = false;
+    table -> serving = false;
+    table -> trace = NULL;
     return table;
 }
 
+// Bloom Filter Start
+
+uint32_t bloom_filter_hash(uint32_t key, uint32_t seed){
+    // Murmur3 finalizer
+    uint32_t hash = key ^ seed;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Bit positions come from double hashing, h1 + i * h2.
+uint32_t bloom_filter_bit(uint32_t key, uint32_t i){
+    uint32_t h1 = bloom_filter_hash(key, 0x9747b28c);
+    uint32_t h2 = bloom_filter_hash(key, 0x5bd1e995) | 1;
+    return (h1 + i * h2) % (BLOOM_FILTER_SIZE * 8);
+}
+
+void bloom_filter_add(BloomFilter* filter, uint32_t key){
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++){
+        uint32_t bit = bloom_filter_bit(key, i);
+        filter -> bits[bit / 8] |= (uint8_t) (1 << (bit % 8));
+    }
+}
+
+bool bloom_filter_may_contain(BloomFilter* filter, uint32_t key){
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++){
+        uint32_t bit = bloom_filter_bit(key, i);
+        if ((filter -> bits[bit / 8] & (1 << (bit % 8))) == 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+void bloom_filter_stamp(BloomFilterHeader* header, int db_file_descriptor){
+    struct stat db_stat;
+    fstat(db_file_descriptor, &db_stat);
+    header -> magic = BLOOM_FILTER_MAGIC;
+    header -> num_hashes = BLOOM_FILTER_NUM_HASHES;
+    header -> db_file_size = db_stat.st_size;
+#ifdef __APPLE__
+    header -> db_mtime_sec = db_stat.st_mtimespec.tv_sec;
+    header -> db_mtime_nsec = db_stat.st_mtimespec.tv_nsec;
+#else
+    header -> db_mtime_sec = db_stat.st_mtim.tv_sec;
+    header -> db_mtime_nsec = db_stat.st_mtim.tv_nsec;
+#endif
+}
+
+// Load the saved filter if it matches the database file, otherwise rebuild it from the leaves.
+BloomFilter* bloom_filter_open(Table* table, const char* db_filename){
+    BloomFilter *filter = calloc(1, sizeof(BloomFilter));
+    filter -> path = malloc(strlen(db_filename) + strlen("-bloom") + 1);
+    sprintf(filter -> path, "%s-bloom", db_filename);
+
+    BloomFilterHeader expected;
+    bloom_filter_stamp(&expected, table -> pager -> file_descriptor);
+
+    int fd = open(filter -> path, O_RDONLY);
+    if (fd != -1){
+        BloomFilterHeader saved;
+        bool valid = read(fd, &saved, sizeof(saved)) == sizeof(saved)
+                     && memcmp(&saved, &expected, sizeof(saved)) == 0
+                     && read(fd, filter -> bits, BLOOM_FILTER_SIZE) == BLOOM_FILTER_SIZE;
+        close(fd);
+        if (valid){
+            return filter;
+        }
+        memset(filter -> bits, 0, BLOOM_FILTER_SIZE);
+    }
+
+    // Missing or stale, rebuild by walking the leaf chain.
+    Cursor *cursor = table_start(table);
+    while (!(cursor -> end_of_table)){
+        void *node = get_page(table -> pager, cursor -> page_num);
+        bloom_filter_add(filter, *leaf_node_key(node, cursor -> cell_num));
+        cursor_advance(cursor);
+    }
+    free(cursor);
+
+    return filter;
+}
+
+void bloom_filter_close(BloomFilter* filter, int db_file_descriptor){
+    BloomFilterHeader header;
+    bloom_filter_stamp(&header, db_file_descriptor);
+
+    int fd = open(filter -> path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1 || write(fd, &header, sizeof(header)) != sizeof(header)
+        || write(fd, filter -> bits, BLOOM_FILTER_SIZE) != BLOOM_FILTER_SIZE){
+        // A missing or partial filter is rebuilt on the next open.
+        printf("Error writing bloom filter: %d\n", errno);
+        unlink(filter -> path);
+    }
+    if (fd != -1){
+        close(fd);
+    }
+
+    free(filter -> path);
+    free(filter);
+}
+// =================================== End
+
 
 // B_TREE_IMPLEMENTATION Start
 
@@ -663,6 +1801,7 @@ void initialize_leaf_node(void *node){
     set_node_root(node, 0);
     *leaf_node_num_cells(node) = 0;
     *leaf_node_next_leaf(node) = 0; // represents no sibling
+    *leaf_node_prev_leaf(node) = 0;
 }
 
 void initialize_internal_node(void *node){
@@ -680,12 +1819,12 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value){
         leaf_node_split_and_insert(cursor, key, value);
         return;
     }
+    pager_mark_dirty(cursor -> table -> pager, cursor -> page_num);
 
     if (cursor -> cell_num < num_cells){
         // Make a room for new cell
-        for (uint32_t i = num_cells; i > cursor -> cell_num; i--){
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
+        memmove(leaf_node_cell(node, cursor -> cell_num + 1), leaf_node_cell(node, cursor -> cell_num),
+                (num_cells - cursor -> cell_num) * LEAF_NODE_CELL_SIZE);
     }
 
     *(leaf_node_num_cells(node)) += 1;
@@ -693,6 +1832,34 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value){
     serialize_row(value, leaf_node_value(node, cursor -> cell_num));
 }
 
+// Merge sorted rows into a leaf that has room for all of them.
+// Works backwards from the end so each run of existing cells is shifted once.
+void leaf_node_merge(void *node, Row* rows, uint32_t num_rows){
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t remaining = num_cells;
+    uint32_t pending = num_rows;
+
+    while (pending > 0){
+        Row *row = &rows[pending - 1];
+
+        uint32_t run_start = remaining;
+        while (run_start > 0 && *leaf_node_key(node, run_start - 1) > row -> id){
+            run_start--;
+        }
+        if (run_start < remaining){
+            memmove(leaf_node_cell(node, run_start + pending), leaf_node_cell(node, run_start),
+                    (remaining - run_start) * LEAF_NODE_CELL_SIZE);
+        }
+
+        remaining = run_start;
+        pending--;
+        *leaf_node_key(node, remaining + pending) = row -> id;
+        serialize_row(row, leaf_node_value(node, remaining + pending));
+    }
+
+    *leaf_node_num_cells(node) = num_cells + num_rows;
+}
+
 Cursor* leaf_node_find(Table*table, uint32_t page_num, uint32_t key){
     void *node = get_page(table -> pager, page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
@@ -729,28 +1896,51 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value){
     // Insert the new value in one of the two nodes.
     // Update parent or create a new parent.
 
-    void *old_node = get_page(cursor -> table -> pager, cursor -> page_num);
+    Table *table = cursor -> table;
+    void *old_node = get_page(table -> pager, cursor -> page_num);
     uint32_t old_max = get_node_max_key(old_node);
-    uint32_t new_page_num = get_unused_page_num(cursor -> table -> pager);
-    void *new_node = get_page(cursor -> table -> pager, new_page_num);
+    uint32_t new_page_num = get_unused_page_num(table -> pager);
+    void *new_node = get_page(table -> pager, new_page_num);
+    pager_mark_dirty(table -> pager, cursor -> page_num);
+    pager_mark_dirty(table -> pager, new_page_num);
+
+    // Appending past the end of the rightmost leaf is the sequential insert pattern.
+    // Leave the old node full and start the new one with just the new key,
+    // so append-only tables end up with completely filled leaves.
+    bool is_rightmost = (*leaf_node_next_leaf(old_node) == 0);
+    bool is_append = is_rightmost && cursor -> cell_num == LEAF_NODE_MAX_CELLS;
+    uint32_t left_split_count = is_append ? LEAF_NODE_APPEND_LEFT_SPLIT_COUNT : LEAF_NODE_LEFT_SPLIT_COUNT;
+    uint32_t right_split_count = is_append ? LEAF_NODE_APPEND_RIGHT_SPLIT_COUNT : LEAF_NODE_RIGHT_SPLIT_COUNT;
+
     initialize_leaf_node(new_node);
     *node_parent(new_node) = *node_parent(old_node);
     *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_prev_leaf(new_node) = cursor -> page_num;
+    if (!is_rightmost){
+        void *next_node = get_page(table -> pager, *leaf_node_next_leaf(old_node));
+        pager_mark_dirty(table -> pager, *leaf_node_next_leaf(old_node));
+        *leaf_node_prev_leaf(next_node) = new_page_num;
+    }
     *leaf_node_next_leaf(old_node) = new_page_num;
+    if (is_rightmost){
+        table -> rightmost_leaf_page_num = new_page_num;
+    }
 
-    // All existing keys plus new key should be divided evenly between old (left) and new (right) nodes.
+    // All existing keys plus new key should be divided between old (left) and new (right) nodes.
     // Starting from the right, move each key to correct position.
 
-    for (uint32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--){
+    for (uint32_t i = LEAF_NODE_MAX_CELLS + 1; i-- > 0; ){
         void *destination_node;
+        uint32_t index_within_node;
 
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT){
+        if (i >= left_split_count){
             destination_node = new_node;
+            index_within_node = i - left_split_count;
         } else {
             destination_node = old_node;
+            index_within_node = i;
         }
 
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
         void *destination = leaf_node_cell(destination_node, index_within_node);
 
         if (i == cursor->cell_num){
@@ -758,23 +1948,24 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value){
             *leaf_node_key(destination_node, index_within_node) = key;
         } else if (i > cursor -> cell_num){
             memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
+        } else if (destination_node != old_node){
             memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
         }
     }
 
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    *(leaf_node_num_cells(old_node)) = left_split_count;
+    *(leaf_node_num_cells(new_node)) = right_split_count;
 
     if (is_node_root(old_node)){
-        return create_new_root(cursor -> table, new_page_num);
+        return create_new_root(table, new_page_num);
     } else {
         uint32_t parent_page_num = *node_parent(old_node);
         uint32_t new_max = get_node_max_key(old_node);
-        void* parent = get_page(cursor -> table -> pager, parent_page_num);
+        void* parent = get_page(table -> pager, parent_page_num);
+        pager_mark_dirty(table -> pager, parent_page_num);
 
         update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor -> table, parent_page_num, new_page_num);
+        internal_node_insert(table, parent_page_num, new_page_num);
         return;
     }
 
@@ -813,7 +2004,7 @@ uint32_t get_node_max_key(void *node){
         case NODE_INTERNAL:
             return *internal_node_key(node, *internal_node_num_keys(node) - 1);
         case NODE_LEAF:
-            return *internal_node_key(node, *leaf_node_num_cells(node) - 1);
+            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
     }
 }
 
@@ -821,6 +2012,10 @@ uint32_t* leaf_node_next_leaf(void *node){
     return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+uint32_t* leaf_node_prev_leaf(void *node){
+    return node + LEAF_NODE_PREV_LEAF_OFFSET;
+}
+
 void update_internal_node_key(void*node, uint32_t old_key, uint32_t new_key){
     uint32_t old_child_index = internal_node_find_child(node, old_key);
     *internal_node_key(node, old_child_index) = new_key;
@@ -836,6 +2031,7 @@ void internal_node_insert(Table*table, uint32_t parent_page_num, uint32_t child_
 
     void* parent = get_page(table -> pager, parent_page_num);
     void* child = get_page(table -> pager, child_page_num);
+    pager_mark_dirty(table -> pager, parent_page_num);
 
     uint32_t child_max_key = get_node_max_key(child);
     uint32_t index = internal_node_find_child(parent, child_max_key);
@@ -873,56 +2069,1090 @@ void internal_node_insert(Table*table, uint32_t parent_page_num, uint32_t child_
 }
 // =================================== End
 
-int main(int argc, char* argv[]) {
-    if (argc < 2){
-        printf("Must supply a database filename.\n");
-        exit(EXIT_FAILURE);
+// Export Start
+// Streams the table straight out of the leaf pages, following the leaf chain.
+// CSV rows are formatted from the cell bytes into one large buffer.
+// The binary format is a header followed by every leaf cell as stored:
+// a 4 byte key and the ROW_SIZE row, gathered with writev without copying.
+
+#define EXPORT_BUFFER_SIZE (256 * 1024)
+#define EXPORT_MAX_IOVECS 64
+const uint32_t EXPORT_BINARY_MAGIC = 0x44425831;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;
+} ExportBinaryHeader;
+
+// Write every iovec in full, resuming after short writes.
+bool write_iovecs(int fd, struct iovec *iovecs, int count){
+    while (count > 0){
+        ssize_t written = writev(fd, iovecs, count);
+        if (written == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t) written >= iovecs -> iov_len){
+            written -= iovecs -> iov_len;
+            iovecs++;
+            count--;
+        }
+        if (count > 0){
+            iovecs -> iov_base += written;
+            iovecs -> iov_len -= written;
+        }
     }
-    char *filename = argv[1];
-    Table *table = db_open(filename);
+    return true;
+}
 
-    InputBuffer * input_buffer = new_input_buffer();
-    while (1) {
-        print_prompt();
-        read_input(input_buffer);
+// Append a CSV field, quoting it if it contains a separator, quote or newline.
+char* export_csv_field(char *out, const char *field, size_t max_length){
+    size_t length = strnlen(field, max_length);
+    if (strcspn(field, ",\"\n") >= length){
+        memcpy(out, field, length);
+        return out + length;
+    }
+
+    *out++ = '"';
+    for (size_t i = 0; i < length; i++){
+        if (field[i] == '"'){
+            *out++ = '"';
+        }
+        *out++ = field[i];
+    }
+    *out++ = '"';
+    return out;
+}
+
+char* export_csv_row(char *out, void *value){
+    uint32_t id;
+    memcpy(&id, value + ID_OFFSET, ID_SIZE);
+
+    char digits[10];
+    int num_digits = 0;
+    do {
+        digits[num_digits++] = '0' + id % 10;
+        id /= 10;
+    } while (id > 0);
+    while (num_digits > 0){
+        *out++ = digits[--num_digits];
+    }
+
+    *out++ = ',';
+    out = export_csv_field(out, value + USERNAME_OFFSET, USERNAME_SIZE);
+    *out++ = ',';
+    out = export_csv_field(out, value + EMAIL_OFFSET, EMAIL_SIZE);
+    *out++ = '\n';
+    return out;
+}
+
+// Write every row to the file descriptor, returns the number of rows or -1 on a write error.
+int64_t table_export(Table* table, int fd, ExportFormat format){
+    Cursor *cursor = table_start(table);
+    uint32_t page_num = cursor -> page_num;
+    free(cursor);
+
+    int64_t num_rows = 0;
+    struct iovec iovecs[EXPORT_MAX_IOVECS];
+    int num_iovecs = 0;
+
+    ExportBinaryHeader header = {EXPORT_BINARY_MAGIC, LEAF_NODE_CELL_SIZE};
+    char *buffer = NULL;
+    char *out = NULL;
+    // Worst case CSV row: every username and email character quoted and doubled.
+    const size_t max_row_length = 10 + 2 * (COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE) + 7;
+
+    if (format == EXPORT_BINARY){
+        iovecs[num_iovecs].iov_base = &header;
+        iovecs[num_iovecs].iov_len = sizeof(header);
+        num_iovecs++;
+    } else {
+        buffer = malloc(EXPORT_BUFFER_SIZE);
+        out = buffer;
+        const char *columns = "id,username,email\n";
+        memcpy(out, columns, strlen(columns));
+        out += strlen(columns);
+    }
+
+    while (1){
+        void *node = get_page(table -> pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
 
-        if (input_buffer->buffer[0] == '.'){
-            switch (do_meta_command(input_buffer, table)) {
-                case (META_COMMAND_SUCCESS):
-                    continue;
-                case (META_UNRECOGNIZED_COMMAND):
-                    printf("Unrecognized command '%s'\n", input_buffer->buffer);
-                    continue;
+        if (format == EXPORT_BINARY){
+            if (num_cells > 0){
+                // Cells are contiguous, so a whole leaf is a single iovec.
+                iovecs[num_iovecs].iov_base = leaf_node_cell(node, 0);
+                iovecs[num_iovecs].iov_len = num_cells * LEAF_NODE_CELL_SIZE;
+                num_iovecs++;
+            }
+            if (num_iovecs == EXPORT_MAX_IOVECS){
+                if (!write_iovecs(fd, iovecs, num_iovecs)){
+                    return -1;
+                }
+                num_iovecs = 0;
+            }
+        } else {
+            for (uint32_t i = 0; i < num_cells; i++){
+                if (out - buffer + max_row_length > EXPORT_BUFFER_SIZE){
+                    iovecs[0].iov_base = buffer;
+                    iovecs[0].iov_len = out - buffer;
+                    if (!write_iovecs(fd, iovecs, 1)){
+                        free(buffer);
+                        return -1;
+                    }
+                    out = buffer;
+                }
+                out = export_csv_row(out, leaf_node_value(node, i));
             }
         }
-        Statement  statement;
-        switch (prepare_statement(input_buffer, &statement)) {
-            case PREPARE_SUCCESS:
+
+        num_rows += num_cells;
+        page_num = *leaf_node_next_leaf(node);
+        if (page_num == 0){
+            break;
+        }
+    }
+
+    if (format == EXPORT_CSV){
+        iovecs[0].iov_base = buffer;
+        iovecs[0].iov_len = out - buffer;
+        num_iovecs = 1;
+    }
+    bool written = write_iovecs(fd, iovecs, num_iovecs);
+    free(buffer);
+    return written ? num_rows : -1;
+}
+// =================================== End
+
+// Snapshot Start
+
+Snapshot* snapshot_open(Table* table){
+    Snapshot *snapshot = calloc(1, sizeof(Snapshot));
+    snapshot -> pager = table -> pager;
+    snapshot -> root_page_num = table -> root_page_num;
+    snapshot -> num_pages = table -> pager -> num_pages;
+
+    snapshot -> next = table -> pager -> snapshots;
+    table -> pager -> snapshots = snapshot;
+    return snapshot;
+}
+
+// Return the page as it was when the snapshot was taken.
+void* snapshot_get_page(Snapshot* snapshot, uint32_t page_num){
+    if (snapshot -> pages[page_num]){
+        return snapshot -> pages[page_num];
+    }
+    return get_page(snapshot -> pager, page_num);
+}
+
+void snapshot_close(Snapshot* snapshot){
+    Snapshot **link = &(snapshot -> pager -> snapshots);
+    while (*link != snapshot){
+        link = &((*link) -> next);
+    }
+    *link = snapshot -> next;
+
+    for (uint32_t i = 0; i < snapshot -> num_pages; i++){
+        free(snapshot -> pages[i]);
+    }
+    free(snapshot);
+}
+
+Backup* backup_start(Table* table, const char* path){
+    if (path == NULL){
+        return NULL;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1){
+        return NULL;
+    }
+
+    Backup *backup = malloc(sizeof(Backup));
+    backup -> snapshot = snapshot_open(table);
+    backup -> file_descriptor = fd;
+    backup -> next_page_num = 0;
+    backup -> path = strdup(path);
+    return backup;
+}
+
+// Copy the next few pages of the snapshot. Returns true once every page is written.
+bool backup_step(Backup* backup){
+    Snapshot *snapshot = backup -> snapshot;
+    uint32_t end = backup -> next_page_num + BACKUP_PAGES_PER_STEP;
+    if (end > snapshot -> num_pages){
+        end = snapshot -> num_pages;
+    }
+
+    for (uint32_t i = backup -> next_page_num; i < end; i++){
+        void *page = snapshot_get_page(snapshot, i);
+        ssize_t bytes_written = pwrite(backup -> file_descriptor, page, PAGE_SIZE, (off_t) i * PAGE_SIZE);
+        if (bytes_written != PAGE_SIZE){
+            return true;
+        }
+        backup -> next_page_num = i + 1;
+    }
+    return backup -> next_page_num == snapshot -> num_pages;
+}
+
+// Write the remaining pages, sync and release the backup. Returns false if a write failed.
+bool backup_finish(Backup* backup){
+    while (!backup_step(backup)){
+    }
+    bool complete = backup -> next_page_num == backup -> snapshot -> num_pages
+                    && fsync(backup -> file_descriptor) == 0;
+
+    close(backup -> file_descriptor);
+    snapshot_close(backup -> snapshot);
+    free(backup -> path);
+    free(backup);
+    return complete;
+}
+
+// Finish the table's running backup and keep its outcome for .backup status.
+bool table_finish_backup(Table* table){
+    free(table -> last_backup_path);
+    table -> last_backup_path = strdup(table -> backup -> path);
+    table -> last_backup_complete = backup_finish(table -> backup);
+    table -> backup = NULL;
+    return table -> last_backup_complete;
+}
+// =================================== End
+
+// Reorganize Start
+// Rebuilds the whole tree into a new file: the leaves in key order on
+// consecutive pages right after the root, repacked to the target fill,
+// then the internal levels above them. The new file replaces the old one
+// with rename, so the database is never seen half rewritten.
+
+// Give every open snapshot its own copy of each page it still shares,
+// page numbers are about to mean something else.
+void pager_detach_snapshots(Pager* pager){
+    for (Snapshot *snapshot = pager -> snapshots; snapshot != NULL; snapshot = snapshot -> next){
+        for (uint32_t i = 0; i < snapshot -> num_pages; i++){
+            if (snapshot -> pages[i] == NULL){
+                snapshot -> pages[i] = malloc(PAGE_SIZE);
+                memcpy(snapshot -> pages[i], get_page(pager, i), PAGE_SIZE);
+            }
+        }
+    }
+}
+
+// Build one internal level over the given children and return its node count.
+// Children are spread evenly, each node's key for a child is that child's max key.
+// The single node of the top level is the root and goes to page 0.
+uint32_t reorganize_build_level(void *pages, uint32_t *child_pages, uint32_t *child_max_keys,
+                                uint32_t num_children, uint32_t *next_page_num){
+    uint32_t max_children = INTERNAL_NODE_MAX_CELLS + 1;
+    uint32_t num_nodes = (num_children + max_children - 1) / max_children;
+    uint32_t child = 0;
+
+    for (uint32_t n = 0; n < num_nodes; n++){
+        uint32_t num_node_children = num_children / num_nodes + (n < num_children % num_nodes ? 1 : 0);
+        uint32_t page_num = num_nodes == 1 ? 0 : (*next_page_num)++;
+        void *node = pages + (size_t) page_num * PAGE_SIZE;
+
+        initialize_internal_node(node);
+        *internal_node_num_keys(node) = num_node_children - 1;
+        for (uint32_t i = 0; i < num_node_children; i++, child++){
+            *internal_node_child(node, i) = child_pages[child];
+            if (i < num_node_children - 1){
+                *internal_node_key(node, i) = child_max_keys[child];
+            }
+            *node_parent(pages + (size_t) child_pages[child] * PAGE_SIZE) = page_num;
+        }
+
+        // This level's nodes are the next level's children.
+        child_pages[n] = page_num;
+        child_max_keys[n] = child_max_keys[child - 1];
+    }
+    return num_nodes;
+}
+
+ExecuteResult execute_reorganize(Statement* statement, Table* table){
+    Pager *pager = table -> pager;
+
+    uint32_t num_rows = 0;
+    Cursor *cursor = table_start(table);
+    for (uint32_t page_num = cursor -> page_num; ; ){
+        void *node = get_page(pager, page_num);
+        num_rows += *leaf_node_num_cells(node);
+        page_num = *leaf_node_next_leaf(node);
+        if (page_num == 0){
+            break;
+        }
+    }
+
+    uint32_t cells_per_leaf = LEAF_NODE_MAX_CELLS * statement -> fill_percent / 100;
+    if (cells_per_leaf == 0){
+        cells_per_leaf = 1;
+    }
+    uint32_t num_leaves = num_rows == 0 ? 1 : (num_rows + cells_per_leaf - 1) / cells_per_leaf;
+
+    uint32_t num_pages = num_leaves;
+    for (uint32_t level_size = num_leaves; level_size > 1; ){
+        level_size = (level_size + INTERNAL_NODE_MAX_CELLS) / (INTERNAL_NODE_MAX_CELLS + 1);
+        num_pages += level_size;
+    }
+    if (num_pages > TABLE_MAX_PAGES){
+        free(cursor);
+        return EXECUTE_TABLE_FULL;
+    }
+
+    // Aligned so the file can be written with O_DIRECT.
+    void *pages = NULL;
+    if (posix_memalign(&pages, PAGER_FRAME_ALIGNMENT, (size_t) num_pages * PAGE_SIZE) != 0){
+        free(cursor);
+        return EXECUTE_IO_ERROR;
+    }
+    memset(pages, 0, (size_t) num_pages * PAGE_SIZE);
+    uint32_t *child_pages = malloc(num_leaves * sizeof(uint32_t));
+    uint32_t *child_max_keys = malloc(num_leaves * sizeof(uint32_t));
+
+    // A single leaf is the root, otherwise the leaves take pages 1 to num_leaves.
+    uint32_t first_leaf = num_leaves == 1 ? 0 : 1;
+    for (uint32_t leaf = 0; leaf < num_leaves; leaf++){
+        uint32_t page_num = first_leaf + leaf;
+        void *node = pages + (size_t) page_num * PAGE_SIZE;
+        initialize_leaf_node(node);
+        *leaf_node_prev_leaf(node) = leaf == 0 ? 0 : page_num - 1;
+        *leaf_node_next_leaf(node) = leaf == num_leaves - 1 ? 0 : page_num + 1;
+
+        uint32_t num_cells = 0;
+        while (num_cells < cells_per_leaf && !(cursor -> end_of_table)){
+            void *source = get_page(pager, cursor -> page_num);
+            memcpy(leaf_node_cell(node, num_cells), leaf_node_cell(source, cursor -> cell_num), LEAF_NODE_CELL_SIZE);
+            num_cells++;
+            cursor_advance(cursor);
+        }
+        *leaf_node_num_cells(node) = num_cells;
+
+        child_pages[leaf] = page_num;
+        child_max_keys[leaf] = num_cells == 0 ? 0 : *leaf_node_key(node, num_cells - 1);
+    }
+    free(cursor);
+
+    uint32_t next_page_num = first_leaf + num_leaves;
+    for (uint32_t level_size = num_leaves; level_size > 1; ){
+        level_size = reorganize_build_level(pages, child_pages, child_max_keys, level_size, &next_page_num);
+    }
+    set_node_root(pages, 1);
+    free(child_pages);
+    free(child_max_keys);
+
+    // Write and sync the new file under the lock before it replaces the old one.
+    char *new_filename = malloc(strlen(pager -> filename) + strlen("-reorganize") + 1);
+    sprintf(new_filename, "%s-reorganize", pager -> filename);
+    int fd = pager_open_file(new_filename, O_RDWR | O_CREAT | O_TRUNC, pager -> flags);
+    bool written = fd != -1
+                   && pwrite(fd, pages, (size_t) num_pages * PAGE_SIZE, 0) == (ssize_t) num_pages * PAGE_SIZE
+                   && fsync(fd) == 0;
+    free(pages);
+
+    if (!written || rename(new_filename, pager -> filename) == -1){
+        int saved_errno = errno;
+        if (fd != -1){
+            close(fd);
+        }
+        unlink(new_filename);
+        free(new_filename);
+        errno = saved_errno;
+        return EXECUTE_IO_ERROR;
+    }
+    free(new_filename);
+
+    // Switch the pager to the new file, pages are read back in on demand.
+    pager_detach_snapshots(pager);
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
+        if (pager -> pages[i]){
+            pager_free_frame(pager, i);
+        }
+        pager -> dirty[i] = false;
+    }
+    close(pager -> file_descriptor);
+    pager -> file_descriptor = fd;
+    pager -> file_length = num_pages * PAGE_SIZE;
+    pager -> num_pages = num_pages;
+
+    table -> root_page_num = 0;
+    table -> rightmost_leaf_page_num = table_rightmost_leaf(table);
+    return EXECUTE_SUCCESS;
+}
+// =================================== End
+
+// Server Mode Start
+// Clients connect over a Unix domain socket and share one Table and Pager.
+// Requests and responses are framed as a 4 byte length in network byte order
+// followed by that many bytes. A request holds one line of input without the
+// newline, the response holds everything the REPL would have printed for it.
+
+#define SERVER_MAX_EVENTS 64
+const uint32_t SERVER_FRAME_HEADER_SIZE = sizeof(uint32_t);
+const uint32_t SERVER_MAX_REQUEST_SIZE = 1 << 20;
+
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_length;
+    size_t in_capacity;
+    char *out;
+    size_t out_length;
+    size_t out_capacity;
+    size_t out_sent;
+    bool closing; // Close once the pending output is written
+} Client;
+
+volatile sig_atomic_t server_stop_requested = 0;
+
+void server_handle_signal(int signal_number){
+    server_stop_requested = 1;
+}
+
+void buffer_reserve(char **buffer, size_t *capacity, size_t required){
+    if (required <= *capacity){
+        return;
+    }
+    size_t new_capacity = *capacity == 0 ? 4096 : *capacity;
+    while (new_capacity < required){
+        new_capacity *= 2;
+    }
+    *buffer = realloc(*buffer, new_capacity);
+    *capacity = new_capacity;
+}
+
+#ifdef __linux__
+
+void client_close(int epoll_fd, Client *client){
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client -> fd, NULL);
+    close(client -> fd);
+    free(client -> in);
+    free(client -> out);
+    free(client);
+}
+
+void client_append_response(Client *client, const char *data, uint32_t length){
+    buffer_reserve(&client -> out, &client -> out_capacity,
+                   client -> out_length + SERVER_FRAME_HEADER_SIZE + length);
+    uint32_t header = htonl(length);
+    memcpy(client -> out + client -> out_length, &header, SERVER_FRAME_HEADER_SIZE);
+    memcpy(client -> out + client -> out_length + SERVER_FRAME_HEADER_SIZE, data, length);
+    client -> out_length += SERVER_FRAME_HEADER_SIZE + length;
+}
+
+// Write as much pending output as the socket takes.
+// Returns false if the client is gone and should be closed.
+bool client_flush(int epoll_fd, Client *client){
+    while (client -> out_sent < client -> out_length){
+        ssize_t written = write(client -> fd, client -> out + client -> out_sent,
+                                client -> out_length - client -> out_sent);
+        if (written == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
                 break;
-            case PREPARE_STRING_TOO_LONG:
-                printf("String is too long.\n");
+            }
+            return false;
+        }
+        client -> out_sent += written;
+    }
+
+    bool pending = client -> out_sent < client -> out_length;
+    if (!pending){
+        client -> out_sent = 0;
+        client -> out_length = 0;
+        if (client -> closing){
+            return false;
+        }
+    }
+
+    // A closing client has nothing more to say, only wait for room to write.
+    struct epoll_event event;
+    event.events = pending ? (client -> closing ? EPOLLOUT : EPOLLIN | EPOLLOUT) : EPOLLIN;
+    event.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client -> fd, &event);
+    return true;
+}
+
+// Run one request against the shared table and queue the captured output as the response.
+void client_execute(Client *client, InputBuffer *input_buffer, Table *table, uint64_t arrival_ns){
+    if (strcmp(input_buffer -> buffer, ".exit") == 0){
+        // Ends this connection only, the table stays open for the others.
+        client -> closing = true;
+        return;
+    }
+
+    char *output = NULL;
+    size_t output_length = 0;
+    FILE *output_stream = open_memstream(&output, &output_length);
+
+    FILE *saved_stdout = stdout;
+    stdout = output_stream;
+    process_input(input_buffer, table, arrival_ns);
+    fflush(output_stream);
+    stdout = saved_stdout;
+    fclose(output_stream);
+
+    client_append_response(client, output, output_length);
+    free(output);
+}
+
+// Read everything available and execute each complete request.
+// Returns false if the client is gone and should be closed.
+bool client_read(Client *client, InputBuffer *input_buffer, Table *table){
+    // Every frame completed by this call had all its bytes by the last successful read.
+    uint64_t received_ns = monotonic_ns();
+    bool end_of_input = false;
+    while (1){
+        buffer_reserve(&client -> in, &client -> in_capacity, client -> in_length + 4096);
+        ssize_t bytes_read = read(client -> fd, client -> in + client -> in_length,
+                                  client -> in_capacity - client -> in_length);
+        if (bytes_read == 0){
+            // The client half-closed, still answer the requests it sent before that.
+            end_of_input = true;
+            break;
+        }
+        if (bytes_read == -1){
+            if (errno == EINTR){
                 continue;
-            case PREPARE_NEGATIVE_ID:
-                printf("ID must be positive.\n");
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            return false;
+        }
+        client -> in_length += bytes_read;
+        received_ns = monotonic_ns();
+    }
+
+    size_t consumed = 0;
+    while (!client -> closing && client -> in_length - consumed >= SERVER_FRAME_HEADER_SIZE){
+        uint32_t header;
+        memcpy(&header, client -> in + consumed, SERVER_FRAME_HEADER_SIZE);
+        uint32_t request_length = ntohl(header);
+        if (request_length > SERVER_MAX_REQUEST_SIZE){
+            return false;
+        }
+        if (client -> in_length - consumed < SERVER_FRAME_HEADER_SIZE + request_length){
+            break;
+        }
+
+        buffer_reserve(&input_buffer -> buffer, &input_buffer -> buffer_length, request_length + 1);
+        memcpy(input_buffer -> buffer, client -> in + consumed + SERVER_FRAME_HEADER_SIZE, request_length);
+        input_buffer -> buffer[request_length] = 0;
+        input_buffer -> input_length = request_length;
+
+        client_execute(client, input_buffer, table, received_ns);
+        consumed += SERVER_FRAME_HEADER_SIZE + request_length;
+    }
+
+    memmove(client -> in, client -> in + consumed, client -> in_length - consumed);
+    client -> in_length -= consumed;
+    if (end_of_input){
+        client -> closing = true;
+    }
+    return true;
+}
+
+void server_accept(int epoll_fd, int listen_fd){
+    while (1){
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1){
+            if (errno == EINTR){
                 continue;
-            case PREPARE_SYNTAX_ERROR:
-                printf("Syntax error. Could not parse statement .\n");
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        Client *client = calloc(1, sizeof(Client));
+        client -> fd = fd;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+            close(fd);
+            free(client);
+        }
+    }
+}
+
+// Serve clients on the given socket path until SIGINT or SIGTERM, then close the table.
+int server_run(const char* socket_path, Table* table){
+    struct sockaddr_un address;
+    if (strlen(socket_path) >= sizeof(address.sun_path)){
+        printf("Socket path is too long.\n");
+        return EXIT_FAILURE;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1){
+        printf("Error creating socket: %d\n", errno);
+        return EXIT_FAILURE;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1){
+        printf("Error listening on %s: %d\n", socket_path, errno);
+        return EXIT_FAILURE;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // The listening socket
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    table -> serving = true;
+    InputBuffer *input_buffer = new_input_buffer();
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (!server_stop_requested){
+        if (table -> backup && backup_step(table -> backup)){
+            bool complete = table_finish_backup(table);
+            printf(complete ? "Backup to %s complete\n" : "Backup to %s failed\n", table -> last_backup_path);
+            fflush(stdout);
+        }
+
+        // Poll without blocking while a backup still has pages to stream.
+        int timeout = table -> backup ? 0 : -1;
+        int num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+        if (num_events == -1){
+            if (errno == EINTR){
                 continue;
-            case PREPARE_UNRECOGNIZED_STATEMENT:
-                printf("Unrecognized keyword at start of '%s' .\n", input_buffer->buffer);
+            }
+            printf("Error waiting for events: %d\n", errno);
+            break;
+        }
+
+        for (int i = 0; i < num_events; i++){
+            Client *client = events[i].data.ptr;
+            if (client == NULL){
+                server_accept(epoll_fd, listen_fd);
                 continue;
+            }
+
+            bool alive = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                alive = client_read(client, input_buffer, table);
+            }
+            if (alive){
+                alive = client_flush(epoll_fd, client);
+            }
+            if (!alive){
+                client_close(epoll_fd, client);
+            }
         }
+    }
 
-        switch (execute_statement(&statement, table)) {
-            case EXECUTE_SUCCESS:
-                printf("Executed .\n");
-                break;
-            case EXECUTE_DUPLICATE_KEY:
-                printf("Error: Duplicate key.\n");
-                break;
-            case EXECUTE_TABLE_FULL:
-                printf("Error: Table full.\n");
+    // Remaining connections are dropped by the process exit, the table is flushed here.
+    close_input_buffer(input_buffer);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    db_close(table);
+    return EXIT_SUCCESS;
+}
+
+#else
+
+int server_run(const char* socket_path, Table* table){
+    printf("Server mode requires epoll and is only supported on Linux.\n");
+    db_close(table);
+    return EXIT_FAILURE;
+}
+
+#endif
+// =================================== End
+
+// Trace Start
+
+uint64_t monotonic_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+Trace* trace_open(const char* path){
+    FILE *file = fopen(path, "wb");
+    if (file == NULL){
+        return NULL;
+    }
+    // Records are small, a large buffer keeps tracing off the statement latency.
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    TraceHeader header = {TRACE_MAGIC, TRACE_VERSION};
+    fwrite(&header, sizeof(header), 1, file);
+
+    Trace *trace = malloc(sizeof(Trace));
+    trace -> file = file;
+    trace -> start_ns = monotonic_ns();
+    return trace;
+}
+
+void trace_record(Trace* trace, uint64_t arrival_ns, uint64_t duration_ns, const char* statement){
+    uint64_t arrival = arrival_ns - trace -> start_ns;
+    uint32_t length = strlen(statement);
+    fwrite(&arrival, sizeof(arrival), 1, trace -> file);
+    fwrite(&duration_ns, sizeof(duration_ns), 1, trace -> file);
+    fwrite(&length, sizeof(length), 1, trace -> file);
+    fwrite(statement, 1, length, trace -> file);
+}
+
+void trace_close(Trace* trace){
+    fclose(trace -> file);
+    free(trace);
+}
+// =================================== End
+
+// Run one line of input, recording it with its timing if a trace is open.
+// arrival_ns is when the line was fully received, so time spent queued counts.
+void process_input(InputBuffer* input_buffer, Table* table, uint64_t arrival_ns){
+    if (table -> trace == NULL){
+        run_input(input_buffer, table);
+        return;
+    }
+
+    // run_input tokenizes the buffer in place, keep the original text.
+    char *statement = strdup(input_buffer -> buffer);
+    uint64_t start_ns = monotonic_ns();
+    run_input(input_buffer, table);
+    uint64_t duration_ns = monotonic_ns() - start_ns;
+
+    trace_record(table -> trace, arrival_ns, duration_ns, statement);
+    free(statement);
+}
+
+void run_input(InputBuffer* input_buffer, Table* table){
+    if (input_buffer->buffer[0] == '.'){
+        switch (do_meta_command(input_buffer, table)) {
+            case (META_COMMAND_SUCCESS):
+                return;
+            case (META_UNRECOGNIZED_COMMAND):
+                printf("Unrecognized command '%s'\n", input_buffer->buffer);
+                return;
+        }
+    }
+    Statement  statement;
+    switch (prepare_statement(input_buffer, &statement)) {
+        case PREPARE_SUCCESS:
+            break;
+        case PREPARE_STRING_TOO_LONG:
+            printf("String is too long.\n");
+            return;
+        case PREPARE_NEGATIVE_ID:
+            printf("ID must be positive.\n");
+            return;
+        case PREPARE_SYNTAX_ERROR:
+            printf("Syntax error. Could not parse statement .\n");
+            return;
+        case PREPARE_UNRECOGNIZED_STATEMENT:
+            printf("Unrecognized keyword at start of '%s' .\n", input_buffer->buffer);
+            return;
+    }
+
+    ExecuteResult execute_result = execute_statement(&statement, table);
+    if (statement.type == STATEMENT_INSERT_BATCH){
+        free(statement.rows_to_insert);
+    }
+
+    switch (execute_result) {
+        case EXECUTE_SUCCESS:
+            printf("Executed .\n");
+            break;
+        case EXECUTE_DUPLICATE_KEY:
+            printf("Error: Duplicate key.\n");
+            break;
+        case EXECUTE_TABLE_FULL:
+            printf("Error: Table full.\n");
+            break;
+        case EXECUTE_IO_ERROR:
+            printf("Error: I/O error %d.\n", errno);
+            break;
+    }
+}
+
+#ifdef DB_REPLAY
+// db_replay <trace file> <db file> [--paced]
+// Replays a trace recorded with --trace against a scratch copy of the database
+// and reports recorded and replayed latency per statement kind.
+
+typedef enum { TRACE_KIND_INSERT, TRACE_KIND_SELECT, TRACE_KIND_UPDATE, TRACE_KIND_META, TRACE_KIND_OTHER } TraceKind;
+#define TRACE_NUM_KINDS 5
+const char *TRACE_KIND_NAMES[TRACE_NUM_KINDS] = {"insert", "select", "update", "meta", "other"};
+
+typedef struct {
+    uint64_t arrival_ns;
+    uint64_t duration_ns;
+    uint64_t replay_duration_ns;
+    char *statement;
+} TraceEntry;
+
+TraceKind trace_kind(const char* statement){
+    if (statement[0] == '.'){
+        return TRACE_KIND_META;
+    } else if (strncmp(statement, "insert", 6) == 0){
+        return TRACE_KIND_INSERT;
+    } else if (strncmp(statement, "select", 6) == 0){
+        return TRACE_KIND_SELECT;
+    } else if (strncmp(statement, "update", 6) == 0){
+        return TRACE_KIND_UPDATE;
+    }
+    return TRACE_KIND_OTHER;
+}
+
+// Statements left out of a replay: .exit would end it, and .backup and .export
+// would overwrite the real files the traced session wrote.
+bool replay_skips(const char* statement){
+    if (strcmp(statement, ".exit") == 0 || strncmp(statement, ".export ", 8) == 0){
+        return true;
+    }
+    return strncmp(statement, ".backup ", 8) == 0 && strcmp(statement, ".backup status") != 0;
+}
+
+TraceEntry* trace_read(const char* path, uint32_t* num_entries){
+    FILE *file = fopen(path, "rb");
+    if (file == NULL){
+        return NULL;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION){
+        fclose(file);
+        return NULL;
+    }
+
+    uint32_t capacity = 1024;
+    TraceEntry *entries = malloc(capacity * sizeof(TraceEntry));
+    *num_entries = 0;
+
+    TraceEntry entry;
+    uint32_t length;
+    while (fread(&entry.arrival_ns, sizeof(uint64_t), 1, file) == 1 &&
+           fread(&entry.duration_ns, sizeof(uint64_t), 1, file) == 1 &&
+           fread(&length, sizeof(uint32_t), 1, file) == 1){
+        entry.statement = malloc(length + 1);
+        if (fread(entry.statement, 1, length, file) != length){
+            free(entry.statement);
+            break; // Truncated final record
+        }
+        entry.statement[length] = 0;
+
+        if (*num_entries == capacity){
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(TraceEntry));
+        }
+        entries[(*num_entries)++] = entry;
+    }
+
+    fclose(file);
+    return entries;
+}
+
+bool copy_file(const char* source_path, const char* destination_path){
+    int destination = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (destination == -1){
+        return false;
+    }
+
+    int source = open(source_path, O_RDONLY);
+    bool copied = true;
+    if (source != -1){
+        char buffer[64 * 1024];
+        ssize_t bytes_read;
+        while ((bytes_read = read(source, buffer, sizeof(buffer))) > 0){
+            if (write(destination, buffer, bytes_read) != bytes_read){
+                copied = false;
                 break;
+            }
+        }
+        close(source);
+    }
+
+    close(destination);
+    return copied;
+}
+
+int compare_uint64(const void *a, const void *b){
+    uint64_t a_value = *(const uint64_t*) a;
+    uint64_t b_value = *(const uint64_t*) b;
+    return (a_value > b_value) - (a_value < b_value);
+}
+
+void print_latencies(const char* title, TraceEntry* entries, uint32_t num_entries, bool replayed){
+    printf("%s latency (us)\n", title);
+    printf("%-10s %8s %10s %10s %10s %10s %10s\n", "statement", "count", "mean", "p50", "p90", "p99", "max");
+
+    uint64_t *durations = malloc((num_entries + 1) * sizeof(uint64_t));
+    for (int kind = 0; kind < TRACE_NUM_KINDS; kind++){
+        uint32_t count = 0;
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < num_entries; i++){
+            if (trace_kind(entries[i].statement) == kind){
+                durations[count] = replayed ? entries[i].replay_duration_ns : entries[i].duration_ns;
+                total += durations[count];
+                count++;
+            }
+        }
+        if (count == 0){
+            continue;
         }
+
+        qsort(durations, count, sizeof(uint64_t), compare_uint64);
+        printf("%-10s %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", TRACE_KIND_NAMES[kind], count,
+               total / 1000.0 / count,
+               durations[(count - 1) * 50 / 100] / 1000.0,
+               durations[(count - 1) * 90 / 100] / 1000.0,
+               durations[(count - 1) * 99 / 100] / 1000.0,
+               durations[count - 1] / 1000.0);
     }
+    free(durations);
 }
+
+int main(int argc, char* argv[]) {
+    if (argc < 3){
+        printf("Usage: db_replay <trace file> <db file> [--paced]\n");
+        exit(EXIT_FAILURE);
+    }
+    bool paced = argc >= 4 && strcmp(argv[3], "--paced") == 0;
+
+    uint32_t num_entries;
+    TraceEntry *entries = trace_read(argv[1], &num_entries);
+    if (entries == NULL){
+        printf("Unable to read trace file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Never replay against the original, statements would be applied twice.
+    char *copy_path = malloc(strlen(argv[2]) + strlen("-replay") + 1);
+    sprintf(copy_path, "%s-replay", argv[2]);
+    if (!copy_file(argv[2], copy_path)){
+        printf("Unable to copy database file\n");
+        exit(EXIT_FAILURE);
+    }
+    Table *table = db_open(copy_path, 0, false);
+
+    FILE *saved_stdout = stdout;
+    FILE *discard = fopen("/dev/null", "w");
+    InputBuffer *input_buffer = new_input_buffer();
+    uint64_t start_ns = monotonic_ns();
+
+    for (uint32_t i = 0; i < num_entries; i++){
+        if (replay_skips(entries[i].statement)){
+            continue;
+        }
+        if (paced){
+            uint64_t elapsed_ns = monotonic_ns() - start_ns;
+            if (entries[i].arrival_ns > elapsed_ns){
+                uint64_t wait_ns = entries[i].arrival_ns - elapsed_ns;
+                struct timespec wait = {wait_ns / 1000000000, wait_ns % 1000000000};
+                nanosleep(&wait, NULL);
+            }
+        }
+
+        size_t length = strlen(entries[i].statement);
+        buffer_reserve(&input_buffer -> buffer, &input_buffer -> buffer_length, length + 1);
+        memcpy(input_buffer -> buffer, entries[i].statement, length + 1);
+        input_buffer -> input_length = length;
+
+        stdout = discard;
+        uint64_t begin_ns = monotonic_ns();
+        process_input(input_buffer, table, begin_ns);
+        entries[i].replay_duration_ns = monotonic_ns() - begin_ns;
+        fflush(discard);
+        stdout = saved_stdout;
+    }
+
+    double elapsed_s = (monotonic_ns() - start_ns) / 1e9;
+    db_close(table);
+    unlink(copy_path);
+    fclose(discard);
+    close_input_buffer(input_buffer);
+
+    uint32_t num_replayed = 0;
+    for (uint32_t i = 0; i < num_entries; i++){
+        if (!replay_skips(entries[i].statement)){
+            entries[num_replayed++] = entries[i];
+        } else {
+            free(entries[i].statement);
+        }
+    }
+
+    printf("Replayed %d statements in %.3f s (%s)\n", num_replayed, elapsed_s, paced ? "paced" : "as fast as possible");
+    print_latencies("Recorded", entries, num_replayed, false);
+    print_latencies("Replayed", entries, num_replayed, true);
+
+    for (uint32_t i = 0; i < num_replayed; i++){
+        free(entries[i].statement);
+    }
+    free(entries);
+    free(copy_path);
+    return EXIT_SUCCESS;
+}
+
+#else
+
+int main(int argc, char* argv[]) {
+    if (argc < 2){
+        printf("Must supply a database filename.\n");
+        exit(EXIT_FAILURE);
+    }
+    char *filename = argv[1];
+    char *socket_path = NULL;
+    char *trace_path = NULL;
+    uint32_t pager_flags = 0;
+    bool use_bloom_filter = false;
+
+    for (int i = 2; i < argc; i++){
+        if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc){
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--direct-io") == 0){
+            pager_flags |= PAGER_DIRECT_IO;
+        } else if (strcmp(argv[i], "--huge-pages") == 0){
+            pager_flags |= PAGER_HUGE_PAGES;
+        } else if (strcmp(argv[i], "--bloom-filter") == 0){
+            use_bloom_filter = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+            trace_path = argv[++i];
+        } else {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Table *table = db_open(filename, pager_flags, use_bloom_filter);
+    if (trace_path != NULL){
+        table -> trace = trace_open(trace_path);
+        if (table -> trace == NULL){
+            printf("Unable to open trace file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (socket_path != NULL){
+        return server_run(socket_path, table);
+    }
+
+    InputBuffer * input_buffer = new_input_buffer();
+    while (1) {
+        print_prompt();
+        read_input(input_buffer);
+        process_input(input_buffer, table, monotonic_ns());
+    }
+}
+
+#endif